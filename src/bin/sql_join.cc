@@ -0,0 +1,65 @@
+#include "SQLHashJoin.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+// Parses a comma-separated list of column numbers, e.g. "0,2,3"
+static bool parse_columns(const char *list, std::vector<size_t> &columns) {
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        char *end;
+        unsigned long column = strtoul(item.c_str(), &end, 10);
+        if (item.empty() || *end != 0) {
+            return false;
+        }
+        columns.push_back(column);
+    }
+    return !columns.empty();
+}
+
+int main(int argc, char *argv[]) {
+    bool outer = false;
+    std::vector<size_t> columns;
+
+    while (argc > 1 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "--outer")) {
+            outer = true;
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-c") && argc > 2 && parse_columns(argv[2], columns)) {
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
+        }
+    }
+
+    if (argc < 5 || argv[1][0] == '-') {
+        std::cerr << "Usage: mw-sql-join [--outer] [-c build-columns] build.sql.gz build-column probe.sql.gz probe-column [threads]" << std::endl;
+        std::cerr << "Columns are numbered from zero.  By default all build columns are joined," << std::endl;
+        std::cerr << "-c takes a comma-separated list of them instead, e.g. -c 1,2." << std::endl;
+        return 1;
+    }
+
+    SQLDumpParser build(argv[1]);
+    SQLJoinTable table(build, atoi(argv[2]), columns);
+    std::cerr << "Loaded " << table.size() << " rows, "
+              << table.memory_usage() / (1024 * 1024) << " MiB" << std::endl;
+
+    SQLDumpParser probe(argv[3]);
+    unsigned threads = argc > 5 ? atoi(argv[5]) : 0;
+    sql_hash_join(table, probe, atoi(argv[4]), threads, outer, [](const SQLRow &row) {
+        for (uint64_t i = 0; i < row.size(); i++) {
+            std::cout << row[i];
+            if (i < row.size() - 1) {
+                std::cout << '\t';
+            } else {
+                std::cout << '\n';
+            }
+        }
+    });
+
+    return 0;
+}
@@ -1,22 +1,80 @@
+#include "CompressedDumpWriter.hh"
 #include "SQLDumpParser.hh"
 
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+// Rows are formatted into chunks of about this size before being written
+#define OUTPUT_CHUNK_SIZE (1024 * 1024)
+
+static void print_row(std::ostream &out, const SQLRow &row) {
+    for (uint64_t i = 0; i < row.size(); i++) {
+        out << row[i];
+        if (i < row.size() - 1) {
+            out << '\t';
+        } else {
+            out << '\n';
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: mw-sql-tsv-dump dump.sql.gz" << std::endl;
+    const char *output = nullptr;
+    unsigned threads = 0;
+
+    while (argc > 3 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-o")) {
+            output = argv[2];
+        } else if (!strcmp(argv[1], "-j")) {
+            threads = atoi(argv[2]);
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc < 2 || argv[1][0] == '-') {
+        std::cerr << "Usage: mw-sql-tsv-dump [-o out.tsv.gz] [-j threads] dump.sql.gz" << std::endl;
+        std::cerr << "The output is compressed on the threads by its extension: .gz, .bz2 or .zst." << std::endl;
         return 1;
     }
 
     SQLDumpParser dump(argv[1]);
-	while (SQLRow_u row = dump.get()) {
-        for (uint64_t i = 0; i < row->size(); i++) {
-            std::cout << (*row)[i];
-            if (i < row->size() - 1) {
-                std::cout << '\t';
-            } else {
-                std::cout << std::endl;
+    if (!output) {
+        while (SQLRow_u row = dump.get()) {
+            print_row(std::cout, *row);
+        }
+        return 0;
+    }
+
+    CompressedDumpWriter_u writer =
+        open_compressed_dump_writer(output, dump_compression_for_path(output), threads);
+    if (!writer) {
+        std::cerr << "Failed to open " << output << std::endl;
+        return 1;
+    }
+
+    // Once a write has failed, the rest of the dump is not worth reading
+    std::ostringstream chunk;
+    bool ok = true;
+    while (SQLRow_u row = dump.get()) {
+        print_row(chunk, *row);
+        if (chunk.tellp() >= OUTPUT_CHUNK_SIZE) {
+            ok = writer->write(chunk.str());
+            chunk.str("");
+            if (!ok) {
+                break;
             }
         }
     }
+    ok = ok && writer->write(chunk.str());
+
+    if (!writer->close() || !ok) {
+        std::cerr << "Failed to write " << output << std::endl;
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,53 @@
+#include "DumpIndex.hh"
+#include "XMLDumpParser.hh"
+
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: mw-xml-dump-index dump.xml.bz2 dump.idx [page-id|title]" << std::endl;
+        return 1;
+    }
+
+    // Without a page to look up, build the index
+    if (argc == 3) {
+        if (!build_dump_index(argv[1], argv[2])) {
+            std::cerr << "Failed to build the index" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    DumpIndex_u index = open_dump_index(argv[2]);
+    if (!index) {
+        std::cerr << "Failed to open the index" << std::endl;
+        return 1;
+    }
+
+    char *end;
+    long long id = strtoll(argv[3], &end, 10);
+    const DumpIndexEntry *entry = *end == '\0' ? index->find_page(id) : index->find_title(argv[3]);
+    if (!entry) {
+        std::cerr << "Page not found" << std::endl;
+        return 1;
+    }
+
+    XMLDumpParser parser(argv[1], PerPage, entry->restart_point(), entry->offset);
+    MediaWikiPageHistory ph = parser.read_page();
+    if (!ph.page) {
+        std::cerr << "Failed to read the page" << std::endl;
+        return 1;
+    }
+
+    std::cout << "== " << ph.page->get_title() << " ==" << std::endl;
+    std::cout << "Page ID: " << ph.page->get_id() << std::endl;
+    std::cout << "Namespace ID: " << ph.page->get_namespace() << std::endl;
+    std::cout << "Revision count: " << ph.revisions.size() << std::endl;
+    if (!ph.revisions.empty()) {
+        std::cout << std::endl;
+        std::cout << ph.revisions.back()->get_text() << std::endl;
+    }
+
+    return 0;
+}
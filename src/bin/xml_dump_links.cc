@@ -0,0 +1,49 @@
+#include "WikiLinks.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+static const char *kind_names[] = {"link", "template", "category"};
+
+static void print_links(const MediaWikiRevision &rev, const std::vector<WikiLinkSpan> &links) {
+    for (const WikiLinkSpan &link : links) {
+        std::cout << rev.get_page()->get_id() << '\t' << rev.get_id() << '\t'
+                  << kind_names[link.kind] << '\t';
+        for (char c : link.target) {
+            std::cout << (c == '\t' || c == '\n' ? ' ' : c);
+        }
+        std::cout << '\n';
+    }
+}
+
+int main(int argc, char *argv[]) {
+    bool latest = argc > 1 && !strcmp(argv[1], "--latest");
+    if (latest) {
+        argc--;
+        argv++;
+    }
+
+    if (argc < 2) {
+        std::cerr << "Usage: mw-xml-dump-links [--latest] dump.xml [threads]" << std::endl;
+        std::cerr << "Prints the page ID, revision ID, kind and target of every link," << std::endl;
+        std::cerr << "of the latest revision of each page only with --latest." << std::endl;
+        return 1;
+    }
+
+    XMLDumpParser parser(argv[1], PerRevision);
+    unsigned threads = argc > 2 ? atoi(argv[2]) : 0;
+    uint64_t total_revisions = 0;
+    uint64_t total_links = 0;
+
+    extract_dump_links(parser, threads, [&](const MediaWikiRevision_s &rev,
+                                            const std::vector<WikiLinkSpan> &links) {
+        total_revisions += 1;
+        total_links += links.size();
+        print_links(*rev, links);
+    }, latest);
+
+    std::cerr << "Found " << total_links << " links in " << total_revisions << " revisions" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+#include "RevisionDataset.hh"
+
+#include <cstring>
+#include <iostream>
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: mw-xml-dump-merge [--compact] delta.xml store.mwrs" << std::endl;
+        std::cerr << "       mw-xml-dump-merge --compact-only store.mwrs" << std::endl;
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "--compact-only")) {
+        if (!compact_dataset(argv[2])) {
+            std::cerr << "Failed to compact " << argv[2] << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    bool compact = !strcmp(argv[1], "--compact");
+    if (compact && argc < 4) {
+        std::cerr << "Usage: mw-xml-dump-merge [--compact] delta.xml store.mwrs" << std::endl;
+        return 1;
+    }
+
+    const char *delta = argv[compact ? 2 : 1];
+    const char *store = argv[compact ? 3 : 2];
+    if (!append_to_dataset(store, delta)) {
+        std::cerr << "Failed to append " << delta << " to " << store << std::endl;
+        return 1;
+    }
+
+    if (compact && !compact_dataset(store)) {
+        std::cerr << "Failed to compact " << store << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
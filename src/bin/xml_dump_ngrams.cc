@@ -0,0 +1,60 @@
+#include "TokenCounter.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+int main(int argc, char *argv[]) {
+    NgramCountOptions options;
+    size_t top = 0;
+    size_t memory_budget = 1024;
+
+    while (argc > 2 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "--all-revisions")) {
+            options.latest_only = false;
+        } else if (!strcmp(argv[1], "--keep-case")) {
+            options.fold_case = false;
+        } else if (!strcmp(argv[1], "-n") && argc > 3) {
+            options.n = atoi(argv[2]);
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "--top") && argc > 3) {
+            top = atoll(argv[2]);
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "--memory") && argc > 3) {
+            memory_budget = atoll(argv[2]);
+            argc--;
+            argv++;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+
+    if (argc < 2 || argv[1][0] == '-' || options.n == 0) {
+        std::cerr << "Usage: mw-xml-dump-ngrams [-n N] [--top K] [--memory MiB] [--all-revisions] [--keep-case] dump.xml [threads]" << std::endl;
+        std::cerr << "Counts the words, or the n-grams of N words, of the latest revision of every page." << std::endl;
+        std::cerr << "Prints every n-gram in byte order, or the K most frequent ones with --top." << std::endl;
+        return 1;
+    }
+
+    XMLDumpParser parser(argv[1], PerRevision);
+    unsigned threads = argc > 2 ? atoi(argv[2]) : 0;
+    TokenCounter counter(memory_budget * 1024 * 1024);
+    count_dump_ngrams(parser, counter, options, threads);
+    std::cerr << "Spilled " << counter.spilled_runs() << " runs" << std::endl;
+
+    if (top > 0) {
+        for (const std::pair<std::string, uint64_t> &entry : counter.top(top, threads)) {
+            std::cout << entry.first << '\t' << entry.second << '\n';
+        }
+    } else {
+        counter.for_each([](std::string_view key, uint64_t count) {
+            std::cout << key << '\t' << count << '\n';
+        });
+    }
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+#include "RevisionStore.hh"
+#include "XMLDumpParser.hh"
+
+#include <iostream>
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: mw-xml-dump-pack dump.xml store.mwrs" << std::endl;
+        return 1;
+    }
+
+    RevisionStoreWriter writer(argv[2]);
+    if (!writer.valid()) {
+        std::cerr << "Failed to open " << argv[2] << std::endl;
+        return 1;
+    }
+
+    XMLDumpParser parser(argv[1], Streaming);
+    uint64_t total_pages = 0;
+    uint64_t total_revisions = 0;
+    for (MediaWikiPage_s page = parser.next_page(); page; page = parser.next_page()) {
+        writer.begin_page(*page);
+        while (MediaWikiRevision_s rev = parser.next_revision()) {
+            writer.add_revision(*rev);
+            total_revisions += 1;
+        }
+        total_pages += 1;
+    }
+
+    if (!writer.finish()) {
+        std::cerr << "Failed to write " << argv[2] << std::endl;
+        return 1;
+    }
+
+    std::cout << "Packed " << total_pages << " pages, " << total_revisions << " revisions" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "DumpMapReduce.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <thread>
+
+struct NamespaceRecord {
+    int32_t ns;
+    uint32_t new_page;
+    uint64_t text_size;
+};
+
+struct NamespaceStats {
+    uint64_t pages = 0;
+    uint64_t revisions = 0;
+    uint64_t text_size = 0;
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: mw-xml-dump-stats dump.xml.bz2 dump.idx [workers]" << std::endl;
+        std::cerr << "Counts the pages, revisions and text bytes in every namespace," << std::endl;
+        std::cerr << "with the dump split among worker processes at the pages in the index." << std::endl;
+        return 1;
+    }
+
+    DumpIndex_u index = open_dump_index(argv[2]);
+    if (!index) {
+        std::cerr << "Failed to open the index" << std::endl;
+        return 1;
+    }
+
+    MapReduceOptions options;
+    options.workers = argc > 3 ? atoi(argv[3]) : 0;
+
+    // A few shards per worker even out the differences between the shards
+    unsigned workers = options.workers ? options.workers : std::thread::hardware_concurrency();
+    std::vector<XMLDumpShard> shards = plan_xml_dump_shards(*index, 4 * std::max(1u, workers));
+
+    MediaWikiPage_s last_page;
+    auto map = [last_page](const MediaWikiRevision &rev, MapOutput &out) mutable {
+        NamespaceRecord record;
+        record.ns = rev.get_page()->get_namespace();
+        record.new_page = rev.get_page() != last_page;
+        record.text_size = rev.get_text_size();
+        last_page = rev.get_page();
+        out.emit(std::string_view(reinterpret_cast<const char *>(&record), sizeof(record)));
+    };
+
+    std::map<int32_t, NamespaceStats> stats;
+    auto reduce = [&stats](size_t shard, std::string_view data) {
+        NamespaceRecord record;
+        memcpy(&record, data.data(), sizeof(record));
+        NamespaceStats &ns = stats[record.ns];
+        ns.pages += record.new_page;
+        ns.revisions += 1;
+        ns.text_size += record.text_size;
+    };
+
+    size_t failed = map_reduce_xml_dump(argv[1], shards, map, reduce, options);
+
+    std::cout << "Namespace\tPages\tRevisions\tText bytes" << std::endl;
+    for (const std::pair<const int32_t, NamespaceStats> &entry : stats) {
+        std::cout << entry.first << '\t' << entry.second.pages << '\t'
+                  << entry.second.revisions << '\t' << entry.second.text_size << std::endl;
+    }
+
+    if (failed > 0) {
+        std::cerr << failed << " of " << shards.size() << " shards failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,112 +1,837 @@
 #include "CompressedDumpReader.hh"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <thread>
+#include <vector>
 
 #include <archive.h>
 #include <bzlib.h>
+#include <lzma.h>
 #include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "ThreadPool.hh"
 
 #define BUFFER_SIZE 8192
+// Larger zstd frames are not cut off the input, but streamed
+#define MAX_PARALLEL_FRAME (64 * 1024 * 1024)
+// Frames which decompress to more, or which do not say, are decompressed
+// in pieces of at most this size
+#define MAX_FRAME_OUTPUT (64 * 1024 * 1024)
+#define LIBARCHIVE_BLOCK_SIZE (1024 * 1024)
 
 // FIXME: this file needs more error handling
 
 class TransparentDumpReader : public CompressedDumpReader {
   private:
-    std::ifstream file;
+    DumpInput_u input;
+    const char *data = nullptr;
+    size_t len = 0;
+
+    bool fill() {
+        if (len == 0 && !input->next(data, len)) {
+            len = 0;
+            return false;
+        }
+        return true;
+    }
 
   public:
-    TransparentDumpReader(const char *path)
-        : CompressedDumpReader(), file(path, std::ifstream::binary) {}
+    TransparentDumpReader(const char *path, DumpRestartPoint start,
+                          const DumpInputOptions &options)
+        : CompressedDumpReader(),
+          input(open_dump_input(path, start.compressed_offset, options)) {}
     virtual ~TransparentDumpReader() {};
 
-    virtual int get() override { return file.get(); }
-    virtual ssize_t read(char *buffer, size_t len) override {
-        file.read(buffer, len);
+    virtual int get() override {
+        if (!fill()) {
+            return std::char_traits<char>::eof();
+        }
 
-        if (!file) {
-            if (file.eof()) {
-                return file.gcount();
-            } else {
-                return -1;
-            }
+        len--;
+        return static_cast<unsigned char>(*data++);
+    }
+
+    virtual ssize_t read(char *buffer, size_t requested) override {
+        size_t copied = 0;
+        while (copied < requested && fill()) {
+            size_t chunk = std::min(requested - copied, len);
+            memcpy(buffer + copied, data, chunk);
+            copied += chunk;
+            data += chunk;
+            len -= chunk;
         }
 
-        return len;
+        if (copied == 0 && input->failed()) {
+            return -1;
+        }
+        return copied;
+    }
+
+    // Any byte of an uncompressed file is a valid restart point
+    virtual DumpRestartPoint restart_point_for(uint64_t offset) override {
+        return {offset, offset};
     }
+
+    bool valid() { return input != nullptr; }
 };
 
 class BulkDumpReader : public CompressedDumpReader {
     virtual int get() override {
         char result;
         if (read(&result, 1) == 1) {
-            return result;
+            return static_cast<unsigned char>(result);
         } else {
             return std::char_traits<char>::eof();
         }
     }
 };
 
-class GzipDumpReader : public CompressedDumpReader {
+/**
+ * Base class for the readers which drive a decompressor by hand rather than
+ * through a FILE-like wrapper, which lets them notice where the individual
+ * compressed streams within the file begin.
+ */
+class StreamDumpReader : public CompressedDumpReader {
   private:
-    gzFile file;
+    // Buffer used to serve get() without a decompressor call per byte
+    char out_buffer[BUFFER_SIZE];
+    size_t out_pos = 0;
+    size_t out_len = 0;
+
+    // Only filled once keep_restart_points() is called, which is done by
+    // the indexer and nothing else
+    std::deque<DumpRestartPoint> restarts;
+    bool keeping_restarts = false;
+
+  protected:
+    DumpInput_u input;
+    // The portion of the compressed file the decompressor is working on
+    const char *in_data = nullptr;
+    size_t in_len = 0;
+    // Offset of in_data[0] within the compressed file
+    uint64_t in_offset;
+    // Number of bytes the decompressor has produced so far
+    uint64_t out_offset;
+
+    /**
+     * Replaces the current portion of the compressed file with the next one.
+     * Returns false at the end of the file.
+     */
+    bool fill_input() {
+        in_offset += in_len;
+        if (!input->next(in_data, in_len)) {
+            in_len = 0;
+            return false;
+        }
+        return true;
+    }
 
-  public:
-    GzipDumpReader(const char *path) : CompressedDumpReader() {
-        file = gzopen(path, "rb");
+    /**
+     * Records that a new compressed stream begins at the specified offset
+     * within the current portion of the input.
+     */
+    void add_restart_point(size_t in_pos) {
+        add_restart_point_at(in_offset + in_pos);
     }
 
-    virtual ~GzipDumpReader() {
-        if (file) {
-            gzclose(file);
-            file = nullptr;
+    void add_restart_point_at(uint64_t compressed_offset) {
+        if (!keeping_restarts) {
+            return;
+        }
+        const DumpRestartPoint &last = restarts.back();
+        if (last.compressed_offset != compressed_offset || last.uncompressed_offset != out_offset) {
+            restarts.push_back({compressed_offset, out_offset});
         }
     }
 
+    /**
+     * Decompresses up to |len| bytes into the buffer.  Returns zero at the
+     * end of the input and a negative value on error.
+     */
+    virtual ssize_t decompress(char *buffer, size_t len) = 0;
+
+  public:
+    StreamDumpReader(const char *path, DumpRestartPoint start,
+                     const DumpInputOptions &options)
+        : CompressedDumpReader(),
+          input(open_dump_input(path, start.compressed_offset, options)),
+          in_offset(start.compressed_offset),
+          out_offset(start.uncompressed_offset) {
+        restarts.push_back(start);
+    }
+
     virtual int get() override {
-        static_assert(std::char_traits<char>::eof() == -1,
-                      "EOF is meant to be -1");
+        if (out_pos == out_len) {
+            ssize_t read = decompress(out_buffer, BUFFER_SIZE);
+            if (read <= 0) {
+                return std::char_traits<char>::eof();
+            }
+            out_pos = 0;
+            out_len = read;
+        }
 
-        return gzgetc(file);
+        return static_cast<unsigned char>(out_buffer[out_pos++]);
     }
 
     virtual ssize_t read(char *buffer, size_t len) override {
-        return gzread(file, buffer, len);
+        size_t buffered = std::min(len, out_len - out_pos);
+        memcpy(buffer, out_buffer + out_pos, buffered);
+        out_pos += buffered;
+        if (buffered == len) {
+            return len;
+        }
+
+        ssize_t read = decompress(buffer + buffered, len - buffered);
+        if (read < 0) {
+            return buffered > 0 ? buffered : read;
+        }
+        return buffered + read;
+    }
+
+    virtual void keep_restart_points() override {
+        keeping_restarts = true;
     }
 
-    bool valid() { return file != nullptr; }
+    virtual DumpRestartPoint restart_point_for(uint64_t offset) override {
+        while (restarts.size() >= 2 && restarts[1].uncompressed_offset <= offset) {
+            restarts.pop_front();
+        }
+        return restarts.front();
+    }
+
+    bool valid() { return input != nullptr; }
 };
 
-class Bzip2DumpReader : public BulkDumpReader {
+/**
+ * Reads gzip files, including the ones which consist of multiple members;
+ * each member is a restart point.  Like gzread(), it ignores whatever follows
+ * the last member if it does not start with the gzip magic.
+ */
+class GzipDumpReader : public StreamDumpReader {
   private:
-    FILE *realfile;
-    BZFILE *file;
+    z_stream stream;
+    bool initialized;
+    // Whether a member has been started but not finished
+    bool in_member = false;
+    bool trailer_reached = false;
 
   public:
-    Bzip2DumpReader(const char *path) : BulkDumpReader() {
-        int error;
-        realfile = fopen(path, "rb");
-        file = BZ2_bzReadOpen(&error, realfile, 0, 0, nullptr, 0);
+    GzipDumpReader(const char *path, DumpRestartPoint start,
+                   const DumpInputOptions &options)
+        : StreamDumpReader(path, start, options) {
+        memset(&stream, 0, sizeof(stream));
+        // 32 enables gzip header detection
+        initialized = inflateInit2(&stream, 15 + 32) == Z_OK;
+    }
+
+    virtual ~GzipDumpReader() {
+        if (initialized) {
+            inflateEnd(&stream);
+        }
+    }
+
+    virtual ssize_t decompress(char *buffer, size_t len) override {
+        stream.next_out = reinterpret_cast<Bytef *>(buffer);
+        stream.avail_out = len;
+
+        while (stream.avail_out > 0 && !trailer_reached) {
+            if (stream.avail_in == 0) {
+                if (!fill_input()) {
+                    // The input ending within a member means it is truncated
+                    if (in_member) {
+                        size_t produced = len - stream.avail_out;
+                        return produced > 0 ? produced : -1;
+                    }
+                    break;
+                }
+                stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in_data));
+                stream.avail_in = in_len;
+            }
+
+            // Zero padding or other garbage after a member is not another one
+            if (!in_member && (stream.next_in[0] != 0x1f ||
+                               (stream.avail_in > 1 && stream.next_in[1] != 0x8b))) {
+                trailer_reached = true;
+                break;
+            }
+
+            size_t avail_out = stream.avail_out;
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            out_offset += avail_out - stream.avail_out;
+            in_member = true;
+
+            if (ret == Z_STREAM_END) {
+                // The next member, if there is one, starts right here
+                inflateReset(&stream);
+                in_member = false;
+                add_restart_point(reinterpret_cast<const char *>(stream.next_in) - in_data);
+            } else if (ret != Z_OK) {
+                return -1;
+            }
+        }
+
+        return len - stream.avail_out;
+    }
+
+    bool valid() { return initialized && StreamDumpReader::valid(); }
+};
+
+/**
+ * Reads bzip2 files, including the multistream ones Wikimedia publishes next
+ * to the regular dumps; each stream is a restart point.
+ */
+class Bzip2DumpReader : public StreamDumpReader {
+  private:
+    bz_stream stream;
+    bool initialized;
+    // Whether a stream has been started but not finished
+    bool in_stream = false;
+
+  public:
+    Bzip2DumpReader(const char *path, DumpRestartPoint start,
+                    const DumpInputOptions &options)
+        : StreamDumpReader(path, start, options) {
+        memset(&stream, 0, sizeof(stream));
+        initialized = BZ2_bzDecompressInit(&stream, 0, 0) == BZ_OK;
     }
 
     virtual ~Bzip2DumpReader() {
-        int error;
+        if (initialized) {
+            BZ2_bzDecompressEnd(&stream);
+        }
+    }
+
+    virtual ssize_t decompress(char *buffer, size_t len) override {
+        stream.next_out = buffer;
+        stream.avail_out = len;
+
+        while (stream.avail_out > 0) {
+            if (stream.avail_in == 0) {
+                if (!fill_input()) {
+                    if (in_stream) {
+                        size_t produced = len - stream.avail_out;
+                        return produced > 0 ? produced : -1;
+                    }
+                    break;
+                }
+                stream.next_in = const_cast<char *>(in_data);
+                stream.avail_in = in_len;
+            }
 
-        if (file && realfile) {
-            BZ2_bzReadClose(&error, file);
-            fclose(realfile);
-            file = nullptr;
-            realfile = nullptr;
+            size_t avail_out = stream.avail_out;
+            int ret = BZ2_bzDecompress(&stream);
+            out_offset += avail_out - stream.avail_out;
+            in_stream = ret != BZ_STREAM_END;
+
+            if (ret == BZ_STREAM_END) {
+                // libbz2 has no reset, so the state has to be recreated while
+                // preserving the unconsumed input and the output position
+                char *next_in = stream.next_in;
+                unsigned int avail_in = stream.avail_in;
+                char *next_out = stream.next_out;
+                unsigned int avail_out = stream.avail_out;
+
+                BZ2_bzDecompressEnd(&stream);
+                memset(&stream, 0, sizeof(stream));
+                initialized = BZ2_bzDecompressInit(&stream, 0, 0) == BZ_OK;
+                if (!initialized) {
+                    return -1;
+                }
+
+                stream.next_in = next_in;
+                stream.avail_in = avail_in;
+                stream.next_out = next_out;
+                stream.avail_out = avail_out;
+                add_restart_point(next_in - in_data);
+            } else if (ret != BZ_OK) {
+                return -1;
+            }
         }
+
+        return len - stream.avail_out;
     }
-    virtual ssize_t read(char *buffer, size_t len) override {
-        int error;
-        return BZ2_bzRead(&error, file, buffer, len);
+
+    bool valid() { return initialized && StreamDumpReader::valid(); }
+};
+
+static unsigned decoder_threads(const DumpInputOptions &options) {
+    if (options.decoder_threads > 0) {
+        return options.decoder_threads;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * Reads xz files with liblzma; each of the concatenated streams is a restart
+ * point.  The streams which xz -T splits into blocks are decompressed on
+ * several threads, but the blocks are not restart points: a file written by
+ * xz -T as a single stream can neither be seeked into nor split among the
+ * workers of a map-reduce.
+ */
+class XzDumpReader : public StreamDumpReader {
+  private:
+    lzma_stream stream = LZMA_STREAM_INIT;
+    unsigned threads;
+    // Whether a stream is being decompressed, as opposed to being between two
+    bool in_stream = false;
+    bool input_done = false;
+
+    bool start_stream() {
+        lzma_ret ret;
+#if LZMA_VERSION >= 50040002
+        if (threads > 1) {
+            lzma_mt mt;
+            memset(&mt, 0, sizeof(mt));
+            mt.threads = threads;
+            // Rather fall back to a single thread than run out of memory
+            mt.memlimit_threading = std::max<uint64_t>(lzma_physmem() / 4, 64 << 20);
+            mt.memlimit_stop = UINT64_MAX;
+            ret = lzma_stream_decoder_mt(&stream, &mt);
+        } else
+#endif
+        ret = lzma_stream_decoder(&stream, UINT64_MAX, 0);
+        in_stream = ret == LZMA_OK;
+        return in_stream;
+    }
+
+    // Skips the zero padding between the streams.  Returns false at the end
+    // of the file.
+    bool skip_padding() {
+        for (;;) {
+            while (stream.avail_in > 0 && *stream.next_in == 0) {
+                stream.next_in++;
+                stream.avail_in--;
+            }
+            if (stream.avail_in > 0) {
+                return true;
+            }
+            if (!fill_input()) {
+                input_done = true;
+                return false;
+            }
+            stream.next_in = reinterpret_cast<const uint8_t *>(in_data);
+            stream.avail_in = in_len;
+        }
+    }
+
+  public:
+    XzDumpReader(const char *path, DumpRestartPoint start,
+                 const DumpInputOptions &options)
+        : StreamDumpReader(path, start, options), threads(decoder_threads(options)) {}
+
+    virtual ~XzDumpReader() {
+        lzma_end(&stream);
+    }
+
+    virtual ssize_t decompress(char *buffer, size_t len) override {
+        stream.next_out = reinterpret_cast<uint8_t *>(buffer);
+        stream.avail_out = len;
+
+        while (stream.avail_out > 0) {
+            if (!in_stream) {
+                if (input_done || !skip_padding()) {
+                    break;
+                }
+                add_restart_point(reinterpret_cast<const char *>(stream.next_in) - in_data);
+                if (!start_stream()) {
+                    return -1;
+                }
+            }
+
+            if (stream.avail_in == 0 && !input_done) {
+                if (fill_input()) {
+                    stream.next_in = reinterpret_cast<const uint8_t *>(in_data);
+                    stream.avail_in = in_len;
+                } else {
+                    input_done = true;
+                }
+            }
+
+            // The multithreaded decoder only flushes what it has buffered
+            // once told that no more input is coming
+            size_t avail_out = stream.avail_out;
+            lzma_ret ret = lzma_code(&stream, input_done ? LZMA_FINISH : LZMA_RUN);
+            out_offset += avail_out - stream.avail_out;
+
+            if (ret == LZMA_STREAM_END) {
+                // Keep the input and output positions for the next stream
+                lzma_end(&stream);
+                in_stream = false;
+            } else if (ret != LZMA_OK) {
+                return -1;
+            }
+        }
+
+        return len - stream.avail_out;
+    }
+};
+
+#ifdef HAVE_ZSTD
+/**
+ * Reads zstd files; each frame is a restart point, which makes the seekable
+ * format and the files written by CompressedDumpWriter seekable.  Frames of
+ * a bounded size are cut off the input and decompressed in parallel, and
+ * the larger ones are streamed through a single context.
+ */
+class ZstdDumpReader : public StreamDumpReader {
+  private:
+    struct Frame {
+        uint64_t compressed_offset;
+        std::string input;
+        std::string output;
+        bool ok = false;
+        // Set while a frame decompressed in pieces has more of them
+        ZSTD_DCtx *context = nullptr;
+        size_t input_pos = 0;
+        bool continued = false;
+
+        ~Frame() { ZSTD_freeDCtx(context); }
+    };
+
+    ZSTD_DCtx *context;
+    std::unique_ptr<ThreadPool> pool;
+    std::unique_ptr<OrderedTasks<Frame>> frames;
+    // Bytes of the current frame already handed out
+    size_t frame_pos = 0;
+
+    // The compressed bytes read from the input but not decompressed yet,
+    // starting at staged_pos; staged[0] is at staged_offset in the file
+    std::string staged;
+    size_t staged_pos = 0;
+    uint64_t staged_offset;
+    bool input_done = false;
+
+    // Whether the next frame is too large to be cut off and has to go
+    // through the streaming context
+    bool streaming = false;
+    bool frame_begins = false;
+    // Whether the streaming context is in the middle of a frame
+    bool in_frame = false;
+
+    enum ScheduleResult {
+        Scheduled,
+        TooLarge,
+        EndOfInput
+    };
+
+    bool stage_more() {
+        if (input_done || !fill_input()) {
+            input_done = true;
+            return false;
+        }
+
+        // Drop the consumed bytes before they outgrow the pending ones
+        if (staged_pos > 0 && staged_pos >= staged.size() - staged_pos) {
+            staged.erase(0, staged_pos);
+            staged_offset += staged_pos;
+            staged_pos = 0;
+        }
+        staged.append(in_data, in_len);
+        return true;
+    }
+
+    ScheduleResult schedule_frame() {
+        for (;;) {
+            size_t avail = staged.size() - staged_pos;
+            if (avail > 0) {
+                size_t size = ZSTD_findFrameCompressedSize(staged.data() + staged_pos, avail);
+                if (!ZSTD_isError(size)) {
+                    std::shared_ptr<Frame> frame = std::make_shared<Frame>();
+                    frame->compressed_offset = staged_offset + staged_pos;
+                    frame->input.assign(staged, staged_pos, size);
+                    staged_pos += size;
+
+                    frames->submit(frame, decompress_frame);
+                    return Scheduled;
+                }
+                if (avail >= MAX_PARALLEL_FRAME) {
+                    return TooLarge;
+                }
+            }
+
+            // An incomplete frame is left to the streaming context to report
+            // as truncated
+            if (!stage_more()) {
+                return avail > 0 ? TooLarge : EndOfInput;
+            }
+        }
     }
+
+    static void decompress_frame(Frame &frame) {
+        unsigned long long size = ZSTD_getFrameContentSize(frame.input.data(), frame.input.size());
+        if (size > MAX_FRAME_OUTPUT) {
+            // Also the unknown size and errors, which are the largest values
+            frame.context = ZSTD_createDCtx();
+            if (frame.context) {
+                decompress_piece(frame);
+            }
+            return;
+        }
+
+        ZSTD_DCtx *context = ZSTD_createDCtx();
+        if (!context) {
+            return;
+        }
+        frame.output.resize(size);
+        size_t ret = ZSTD_decompressDCtx(context, &frame.output[0], size,
+                                         frame.input.data(), frame.input.size());
+        frame.ok = !ZSTD_isError(ret) && ret == size;
+        ZSTD_freeDCtx(context);
+        std::string().swap(frame.input);
+    }
+
+    // Decompresses up to MAX_FRAME_OUTPUT bytes of the frame through its own
+    // context, and drops the context once the frame is complete
+    static void decompress_piece(Frame &frame) {
+        ZSTD_inBuffer in = {frame.input.data(), frame.input.size(), frame.input_pos};
+        size_t produced = 0;
+        bool complete = false;
+        frame.ok = true;
+        while (frame.ok && !complete) {
+            if (produced == frame.output.size()) {
+                if (produced == MAX_FRAME_OUTPUT) {
+                    break;
+                }
+                frame.output.resize(std::min<size_t>(std::max<size_t>(2 * produced, 1 << 20),
+                                                     MAX_FRAME_OUTPUT));
+            }
+            ZSTD_outBuffer out = {&frame.output[0], frame.output.size(), produced};
+            size_t ret = ZSTD_decompressStream(frame.context, &out, &in);
+            produced = out.pos;
+
+            complete = ret == 0;
+            frame.ok = !ZSTD_isError(ret) && (complete || in.pos < in.size || out.pos == out.size);
+        }
+        frame.output.resize(produced);
+        frame.input_pos = in.pos;
+
+        if (complete || !frame.ok) {
+            ZSTD_freeDCtx(frame.context);
+            frame.context = nullptr;
+            std::string().swap(frame.input);
+        }
+    }
+
+    // Starts decompressing frames until enough of them are in flight
+    void schedule_frames() {
+        while (!streaming && !frames->full()) {
+            ScheduleResult result = schedule_frame();
+            if (result == TooLarge) {
+                streaming = true;
+                frame_begins = true;
+            }
+            if (result != Scheduled) {
+                break;
+            }
+        }
+    }
+
+    // Decompresses from the staged bytes through the streaming context
+    ssize_t decompress_streaming(char *buffer, size_t len) {
+        ZSTD_outBuffer out = {buffer, len, 0};
+
+        while (out.pos < out.size) {
+            // At the end of the input, the context may still hold the rest
+            // of a frame; if it does not, the frame is truncated
+            bool flushing = staged_pos == staged.size() && !stage_more();
+            if (flushing && !in_frame) {
+                break;
+            }
+            if (frame_begins) {
+                add_restart_point_at(staged_offset + staged_pos);
+                frame_begins = false;
+            }
+
+            ZSTD_inBuffer in = {staged.data() + staged_pos, staged.size() - staged_pos, 0};
+            size_t before = out.pos;
+            size_t ret = ZSTD_decompressStream(context, &out, &in);
+            staged_pos += in.pos;
+            out_offset += out.pos - before;
+
+            if (ZSTD_isError(ret) || (flushing && ret != 0 && out.pos == before)) {
+                return out.pos > 0 ? out.pos : -1;
+            }
+            in_frame = ret != 0;
+            if (ret == 0) {
+                frame_begins = true;
+                // Let the following frames go back to the thread pool
+                if (pool) {
+                    streaming = false;
+                    break;
+                }
+            }
+        }
+
+        return out.pos;
+    }
+
+  public:
+    ZstdDumpReader(const char *path, DumpRestartPoint start,
+                   const DumpInputOptions &options)
+        : StreamDumpReader(path, start, options),
+          context(ZSTD_createDCtx()),
+          staged_offset(start.compressed_offset) {
+        unsigned threads = decoder_threads(options);
+        if (threads > 1) {
+            pool.reset(new ThreadPool(threads));
+            frames.reset(new OrderedTasks<Frame>(*pool));
+        } else {
+            streaming = true;
+        }
+    }
+
+    virtual ~ZstdDumpReader() {
+        // The tasks refer to the frames, not to the reader
+        frames.reset();
+        pool.reset();
+        ZSTD_freeDCtx(context);
+    }
+
+    virtual ssize_t decompress(char *buffer, size_t len) override {
+        size_t produced = 0;
+
+        while (produced < len) {
+            if (frames && !frames->empty()) {
+                Frame &frame = frames->front();
+                if (frame_pos == 0) {
+                    if (!frame.ok) {
+                        return produced > 0 ? produced : -1;
+                    }
+                    if (!frame.continued) {
+                        add_restart_point_at(frame.compressed_offset);
+                    }
+                }
+
+                size_t chunk = std::min(len - produced, frame.output.size() - frame_pos);
+                memcpy(buffer + produced, frame.output.data() + frame_pos, chunk);
+                produced += chunk;
+                frame_pos += chunk;
+                out_offset += chunk;
+
+                if (frame_pos == frame.output.size()) {
+                    frame_pos = 0;
+                    if (frame.context) {
+                        frame.continued = true;
+                        decompress_piece(frame);
+                    } else {
+                        frames->pop();
+                        schedule_frames();
+                    }
+                }
+                continue;
+            }
+
+            if (streaming) {
+                ssize_t read = decompress_streaming(buffer + produced, len - produced);
+                if (read < 0) {
+                    return produced > 0 ? produced : -1;
+                }
+                produced += read;
+                if (read == 0 && streaming) {
+                    break;
+                }
+                continue;
+            }
+
+            schedule_frames();
+            if (frames->empty() && !streaming) {
+                break;
+            }
+        }
+
+        return produced;
+    }
+
+    bool valid() { return context && StreamDumpReader::valid(); }
+};
+#endif
+
+#ifdef HAVE_LZ4
+/**
+ * Reads lz4 frame files; each frame is a restart point.
+ */
+class Lz4DumpReader : public StreamDumpReader {
+  private:
+    LZ4F_dctx *context = nullptr;
+    size_t in_pos = 0;
+    bool frame_begins = false;
+    // Whether the context is in the middle of a frame
+    bool in_frame = false;
+
+  public:
+    Lz4DumpReader(const char *path, DumpRestartPoint start,
+                  const DumpInputOptions &options)
+        : StreamDumpReader(path, start, options) {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&context, LZ4F_VERSION))) {
+            context = nullptr;
+        }
+    }
+
+    virtual ~Lz4DumpReader() {
+        if (context) {
+            LZ4F_freeDecompressionContext(context);
+        }
+    }
+
+    virtual ssize_t decompress(char *buffer, size_t len) override {
+        size_t produced = 0;
+
+        while (produced < len) {
+            // At the end of the input, the context may still hold the rest
+            // of a frame; if it does not, the frame is truncated
+            bool flushing = false;
+            if (in_pos == in_len) {
+                bool more = fill_input();
+                in_pos = 0;
+                if (!more && !in_frame) {
+                    break;
+                }
+                flushing = !more;
+            }
+            if (frame_begins) {
+                add_restart_point(in_pos);
+                frame_begins = false;
+            }
+
+            size_t out_size = len - produced;
+            size_t in_size = in_len - in_pos;
+            size_t ret = LZ4F_decompress(context, buffer + produced, &out_size,
+                                         in_data + in_pos, &in_size, nullptr);
+            in_pos += in_size;
+            produced += out_size;
+            out_offset += out_size;
+
+            if (LZ4F_isError(ret) || (flushing && ret != 0 && out_size == 0)) {
+                return produced > 0 ? produced : -1;
+            }
+            in_frame = ret != 0;
+            // The context starts over by itself once a frame is complete
+            if (ret == 0) {
+                frame_begins = true;
+            }
+        }
+
+        return produced;
+    }
+
+    bool valid() { return context && StreamDumpReader::valid(); }
 };
+#endif
 
+/**
+ * Reads 7z archives, the one format left without a native reader.
+ */
 class LibarchiveDumpReader : public BulkDumpReader {
   private:
     struct archive *arch;
@@ -115,10 +840,9 @@ class LibarchiveDumpReader : public BulkDumpReader {
   public:
     LibarchiveDumpReader(const char *path) : BulkDumpReader() {
         arch = archive_read_new();
-        archive_read_support_filter_all(arch);
-        archive_read_support_format_all(arch);
+        archive_read_support_format_7zip(arch);
 
-        err = archive_read_open_filename(arch, path, 65536) != ARCHIVE_OK;
+        err = archive_read_open_filename(arch, path, LIBARCHIVE_BLOCK_SIZE) != ARCHIVE_OK;
         if (err) {
             return;
         }
@@ -142,45 +866,86 @@ class LibarchiveDumpReader : public BulkDumpReader {
     bool valid() { return !err; }
 };
 
+template <typename T>
+static CompressedDumpReader_u validate_reader(T *reader) {
+    if (!reader->valid()) {
+        delete reader;
+        return nullptr;
+    }
+    return CompressedDumpReader_u(reader);
+}
+
+template <typename T>
+static CompressedDumpReader_u open_reader(const char *path, DumpRestartPoint start,
+                                          const DumpInputOptions &options) {
+    return validate_reader(new T(path, start, options));
+}
+
 /**
- * Attempt to determine the type of the file based on the first
- * 10 characters of it.
+ * The codecs in the order of registration; the native readers come before
+ * libarchive, which is only left with 7z.
  */
-CompressedDumpReader_u open_compressed_dump(const char *path) {
-    std::ifstream file{path, std::ifstream::binary};
-    char preamble[10];
+static std::vector<DumpCodec> &dump_codecs() {
+    static std::vector<DumpCodec> codecs = {
+        {"sql", "-- ", true, open_reader<TransparentDumpReader>},
+        {"xml", "<mediawiki", true, open_reader<TransparentDumpReader>},
+        {"gzip", std::string("\x1f\x8b\x08", 3), true, open_reader<GzipDumpReader>},
+        {"bzip2", "BZh", true, open_reader<Bzip2DumpReader>},
+        {"xz", std::string("\xfd" "7zXZ\0", 6), true, open_reader<XzDumpReader>},
+#ifdef HAVE_ZSTD
+        {"zstd", "\x28\xb5\x2f\xfd", true, open_reader<ZstdDumpReader>},
+#endif
+#ifdef HAVE_LZ4
+        {"lz4", "\x04\x22\x4d\x18", true, open_reader<Lz4DumpReader>},
+#endif
+        // 7-zip archives are solid, so they can only be read from the beginning
+        {"7z", "7z\xbc\xaf\x27\x1c", false,
+         [](const char *path, DumpRestartPoint, const DumpInputOptions &) {
+             return validate_reader(new LibarchiveDumpReader(path));
+         }},
+    };
+    return codecs;
+}
 
-    file.read(preamble, 10);
-    if (!file) {
-        return nullptr;
-    }
+void register_dump_codec(DumpCodec codec) {
+    dump_codecs().push_back(std::move(codec));
+}
 
-    // Raw SQL dump
-    if (!memcmp("-- ", preamble, 3)) {
-        return CompressedDumpReader_u(new TransparentDumpReader(path));
+const DumpCodec *detect_dump_codec(const char *path) {
+    const std::vector<DumpCodec> &codecs = dump_codecs();
+    size_t longest = 0;
+    for (const DumpCodec &codec : codecs) {
+        longest = std::max(longest, codec.magic.size());
     }
 
-    // Raw XML dump
-    if (!memcmp("<mediawiki", preamble, 10)) {
-        return CompressedDumpReader_u(new TransparentDumpReader(path));
-    }
+    std::ifstream file{path, std::ifstream::binary};
+    std::string preamble(longest, '\0');
+    file.read(&preamble[0], longest);
+    preamble.resize(file.gcount());
 
-    // Gzip
-    if (!memcmp("\x1f\x8b\x08", preamble, 3)) {
-        return CompressedDumpReader_u(new GzipDumpReader(path));
+    for (auto codec = codecs.rbegin(); codec != codecs.rend(); ++codec) {
+        if (!preamble.compare(0, codec->magic.size(), codec->magic)) {
+            return &*codec;
+        }
     }
+    return nullptr;
+}
 
-    // Bzip2
-    if (!memcmp("BZh", preamble, 3)) {
-        return CompressedDumpReader_u(new Bzip2DumpReader(path));
-    }
+CompressedDumpReader_u open_compressed_dump(const char *path,
+                                            DumpRestartPoint start) {
+    return open_compressed_dump(path, start, default_dump_input_options());
+}
 
-    // 7-zip
-    if (!memcmp("7z\xbc\xaf\x27\x1c", preamble, 6)) {
-        return CompressedDumpReader_u(new LibarchiveDumpReader(path));
+CompressedDumpReader_u open_compressed_dump(const char *path,
+                                            DumpRestartPoint start,
+                                            const DumpInputOptions &options) {
+    const DumpCodec *codec = detect_dump_codec(path);
+    if (!codec) {
+        return nullptr;
     }
 
-    // Play safe and return error
-    return nullptr;
-
+    if (!codec->seekable && (start.compressed_offset != 0 || start.uncompressed_offset != 0)) {
+        return nullptr;
+    }
+    return codec->open(path, start, options);
 }
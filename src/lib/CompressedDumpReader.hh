@@ -1,14 +1,52 @@
 #ifndef __COMPRESSEDDUMPREADER_HH
 #define __COMPRESSEDDUMPREADER_HH
 
+#include <cstdint>
 #include <cstdio>
+#include <functional>
 #include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+#include "DumpInput.hh"
+
+/**
+ * A position in the dump from which decompression can be started afresh,
+ * such as the beginning of a bzip2 stream or of a gzip member, together
+ * with the offset in the uncompressed data it corresponds to.
+ */
+struct DumpRestartPoint {
+    uint64_t compressed_offset;
+    uint64_t uncompressed_offset;
+};
 
 class CompressedDumpReader {
   public:
     virtual int get() = 0;
     virtual ssize_t read(char *buffer, size_t len) = 0;
 
+    /**
+     * Makes the reader remember the restart points it passes from now on.
+     * They cost memory for every stream in the file, so only the readers
+     * which are going to be asked for them keep them.
+     */
+    virtual void keep_restart_points() {}
+
+    /**
+     * Returns the last restart point located at or before the specified
+     * uncompressed offset.  Readers only remember the points which may still
+     * be asked for, so the offsets have to be queried in non-decreasing order,
+     * and only after keep_restart_points(); otherwise the result is the point
+     * the reader was opened at.
+     *
+     * A file consisting of a single compressed stream has no restart point
+     * but the beginning.  This is the case for 7z archives, but also for the
+     * single-member gzip and single-stream bzip2 dumps Wikimedia publishes;
+     * only the multistream bzip2 dumps can actually be entered in the middle.
+     */
+    virtual DumpRestartPoint restart_point_for(uint64_t) { return {0, 0}; }
+
     CompressedDumpReader() {}
     CompressedDumpReader(CompressedDumpReader const&) = delete;
     virtual ~CompressedDumpReader() {}
@@ -16,6 +54,52 @@ class CompressedDumpReader {
 
 typedef std::unique_ptr<CompressedDumpReader> CompressedDumpReader_u;
 
-CompressedDumpReader_u open_compressed_dump(const char *path);
+/**
+ * A file format open_compressed_dump() recognizes.  The format is detected
+ * from the first bytes of the file, and the codec whose magic is found there
+ * opens the reader.  The built-in codecs are the uncompressed SQL and XML
+ * dumps, gzip, bzip2, xz, 7z, and zstd and lz4 when mwdump is built with
+ * them.
+ */
+struct DumpCodec {
+    typedef std::function<CompressedDumpReader_u(const char *path, DumpRestartPoint start,
+                                                 const DumpInputOptions &options)> Factory;
+
+    const char *name;
+    std::string magic;
+    // Whether the reader can start at a restart point other than the beginning
+    bool seekable;
+    Factory open;
+};
+
+/**
+ * Adds a codec, which takes precedence over the ones registered before it
+ * when both magics match.  Codecs should be registered before opening any
+ * dumps.
+ */
+void register_dump_codec(DumpCodec codec);
+
+/**
+ * Returns the codec of the file, or nullptr if the file cannot be read or
+ * its format is not recognized.
+ */
+const DumpCodec *detect_dump_codec(const char *path);
+
+/**
+ * Opens the dump and positions the reader at the specified restart point.
+ * Returns nullptr if the format is not recognized, or if the format does not
+ * support starting anywhere but at the beginning.
+ */
+CompressedDumpReader_u open_compressed_dump(const char *path,
+                                            DumpRestartPoint start = {0, 0});
+
+/**
+ * Same as above, but reads the file in the specified way instead of the one
+ * default_dump_input_options() describes.  The 7z archives are read by
+ * libarchive itself and ignore the options.
+ */
+CompressedDumpReader_u open_compressed_dump(const char *path,
+                                            DumpRestartPoint start,
+                                            const DumpInputOptions &options);
 
 #endif /* __COMPRESSEDDUMPREADER_HH */
@@ -0,0 +1,275 @@
+#include "CompressedDumpWriter.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <bzlib.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "ThreadPool.hh"
+
+#define GZIP_BLOCK_SIZE (1024 * 1024)
+// A stream of a single block at the highest level
+#define BZIP2_BLOCK_SIZE (900 * 1000)
+#define ZSTD_BLOCK_SIZE (4 * 1024 * 1024)
+
+static bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = ::write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+/*************************** Block compressors ***************************/
+typedef bool (*BlockCompressor)(const std::string &in, std::string &out, int level);
+
+static bool gzip_block(const std::string &in, std::string &out, int level) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // 16 means a gzip header and trailer instead of the zlib ones
+    if (deflateInit2(&strm, level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED,
+                     15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    out.resize(deflateBound(&strm, in.size()));
+    strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    strm.avail_in = in.size();
+    strm.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    strm.avail_out = out.size();
+
+    int ret = deflate(&strm, Z_FINISH);
+    out.resize(out.size() - strm.avail_out);
+    deflateEnd(&strm);
+    return ret == Z_STREAM_END;
+}
+
+static bool bzip2_block(const std::string &in, std::string &out, int level) {
+    // The documented worst case is 1% larger plus 600 bytes
+    unsigned int out_len = in.size() + in.size() / 100 + 600;
+    out.resize(out_len);
+    int ret = BZ2_bzBuffToBuffCompress(&out[0], &out_len, const_cast<char *>(in.data()),
+                                       in.size(), level < 0 ? 9 : level, 0, 0);
+    out.resize(out_len);
+    return ret == BZ_OK;
+}
+
+#ifdef HAVE_ZSTD
+static bool zstd_block(const std::string &in, std::string &out, int level) {
+    out.resize(ZSTD_compressBound(in.size()));
+    size_t ret = ZSTD_compress(&out[0], out.size(), in.data(), in.size(),
+                               level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+    if (ZSTD_isError(ret)) {
+        return false;
+    }
+    out.resize(ret);
+    return true;
+}
+#endif
+
+/*************************** Writers ***************************/
+class PlainDumpWriter : public CompressedDumpWriter {
+  private:
+    int fd;
+    bool failed = false;
+
+  public:
+    PlainDumpWriter(int _fd) : fd(_fd) {}
+
+    virtual ~PlainDumpWriter() {
+        if (fd >= 0) {
+            close();
+        }
+    }
+
+    virtual bool write(const char *data, size_t len) override {
+        if (!write_all(fd, data, len)) {
+            failed = true;
+        }
+        return !failed;
+    }
+
+    virtual bool close() override {
+        if (::close(fd) < 0) {
+            failed = true;
+        }
+        fd = -1;
+        return !failed;
+    }
+};
+
+class BlockDumpWriter : public CompressedDumpWriter {
+  private:
+    struct Block {
+        std::string input;
+        std::string output;
+        bool compressed = false;
+    };
+
+    int fd;
+    BlockCompressor compressor;
+    size_t block_size;
+    int level;
+
+    ThreadPool pool;
+    OrderedTasks<Block> blocks;
+    std::string pending;
+    bool any_block = false;
+    bool failed = false;
+
+    void submit() {
+        std::shared_ptr<Block> block = std::make_shared<Block>();
+        block->input.swap(pending);
+        pending.reserve(block_size);
+        any_block = true;
+
+        BlockCompressor compress = compressor;
+        int block_level = level;
+        blocks.submit(block, [compress, block_level](Block &block) {
+            block.compressed = compress(block.input, block.output, block_level);
+            std::string().swap(block.input);
+        });
+
+        // Bound the memory held by the blocks waiting to be written
+        while (blocks.full()) {
+            deliver();
+        }
+    }
+
+    // Writes out the oldest block, so the output is in the order of input
+    void deliver() {
+        const Block &block = blocks.front();
+        if (!block.compressed || !write_all(fd, block.output.data(), block.output.size())) {
+            failed = true;
+        }
+        blocks.pop();
+    }
+
+  public:
+    BlockDumpWriter(int _fd, BlockCompressor _compressor, size_t _block_size,
+                    unsigned threads, int _level)
+        : fd(_fd), compressor(_compressor), block_size(_block_size), level(_level),
+          pool(threads), blocks(pool) {
+        pending.reserve(block_size);
+    }
+
+    virtual ~BlockDumpWriter() {
+        if (fd >= 0) {
+            close();
+        }
+    }
+
+    virtual bool write(const char *data, size_t len) override {
+        while (len > 0) {
+            size_t chunk = std::min(len, block_size - pending.size());
+            pending.append(data, chunk);
+            data += chunk;
+            len -= chunk;
+            if (pending.size() == block_size) {
+                submit();
+            }
+        }
+        return !failed;
+    }
+
+    virtual bool close() override {
+        // Even an empty file has to be a valid compressed one
+        if (!pending.empty() || !any_block) {
+            submit();
+        }
+        while (!blocks.empty()) {
+            deliver();
+        }
+
+        if (::close(fd) < 0) {
+            failed = true;
+        }
+        fd = -1;
+        return !failed;
+    }
+};
+
+/*************************** Public API ***************************/
+static bool ends_with(const char *str, const char *suffix) {
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && !strcmp(str + len - suffix_len, suffix);
+}
+
+DumpCompression dump_compression_for_path(const char *path) {
+    if (ends_with(path, ".gz")) {
+        return GzipCompression;
+    }
+    if (ends_with(path, ".bz2")) {
+        return Bzip2Compression;
+    }
+    if (ends_with(path, ".zst")) {
+        return ZstdCompression;
+    }
+    return Uncompressed;
+}
+
+CompressedDumpWriter_u open_compressed_dump_writer(const char *path,
+                                                   DumpCompression compression,
+                                                   unsigned threads,
+                                                   int level) {
+    BlockCompressor compressor = nullptr;
+    size_t block_size = 0;
+    switch (compression) {
+        case Uncompressed:
+            break;
+        case GzipCompression:
+            if (level > Z_BEST_COMPRESSION) {
+                return nullptr;
+            }
+            compressor = gzip_block;
+            block_size = GZIP_BLOCK_SIZE;
+            break;
+        case Bzip2Compression:
+            // bzip2 has no level 0
+            if (level == 0 || level > 9) {
+                return nullptr;
+            }
+            compressor = bzip2_block;
+            block_size = BZIP2_BLOCK_SIZE;
+            break;
+        case ZstdCompression:
+#ifdef HAVE_ZSTD
+            if (level > ZSTD_maxCLevel()) {
+                return nullptr;
+            }
+            compressor = zstd_block;
+            block_size = ZSTD_BLOCK_SIZE;
+            break;
+#else
+            return nullptr;
+#endif
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    if (!compressor) {
+        return CompressedDumpWriter_u(new PlainDumpWriter(fd));
+    }
+    return CompressedDumpWriter_u(new BlockDumpWriter(fd, compressor, block_size, threads, level));
+}
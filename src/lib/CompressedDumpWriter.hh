@@ -0,0 +1,57 @@
+#ifndef __COMPRESSEDDUMPWRITER_HH
+#define __COMPRESSEDDUMPWRITER_HH
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+enum DumpCompression {
+    Uncompressed,
+    GzipCompression,
+    Bzip2Compression,
+    ZstdCompression
+};
+
+/**
+ * Writes a compressed file by cutting the data into blocks and compressing
+ * every block independently on a thread pool.  Each block becomes a complete
+ * gzip member, bzip2 stream or zstd frame, and their concatenation is a valid
+ * file for the usual tools as well as for CompressedDumpReader; the block
+ * boundaries double as its restart points.
+ */
+class CompressedDumpWriter {
+  public:
+    virtual bool write(const char *data, size_t len) = 0;
+    inline bool write(std::string_view data) { return write(data.data(), data.size()); }
+
+    /**
+     * Compresses and writes whatever is buffered, and closes the file.
+     * Returns false if any write has failed.
+     */
+    virtual bool close() = 0;
+
+    CompressedDumpWriter() {}
+    CompressedDumpWriter(CompressedDumpWriter const&) = delete;
+    virtual ~CompressedDumpWriter() {}
+};
+
+typedef std::unique_ptr<CompressedDumpWriter> CompressedDumpWriter_u;
+
+/**
+ * Guesses the compression from the extension: .gz, .bz2 and .zst.
+ */
+DumpCompression dump_compression_for_path(const char *path);
+
+/**
+ * Creates the file.  Zero threads means one per core, and a negative level
+ * the default of the format.  Returns nullptr if the file cannot be created,
+ * if the level is out of the range of the format, or if the format has not
+ * been compiled in.
+ */
+CompressedDumpWriter_u open_compressed_dump_writer(const char *path,
+                                                   DumpCompression compression,
+                                                   unsigned threads = 0,
+                                                   int level = -1);
+
+#endif /* __COMPRESSEDDUMPWRITER_HH */
@@ -0,0 +1,160 @@
+#include "DumpIndex.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "XMLDumpParser.hh"
+
+static const char index_magic[8] = {'M', 'W', 'D', 'I', 'D', 'X', '0', '1'};
+
+uint64_t dump_title_hash(const std::string &title) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : title) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*************************** DumpIndex ***************************/
+DumpIndex::DumpIndex(void *_map, size_t _map_size) {
+    map = _map;
+    map_size = _map_size;
+
+    const DumpIndexHeader *header = static_cast<const DumpIndexHeader *>(map);
+    entry_count = header->entry_count;
+    entries = reinterpret_cast<const DumpIndexEntry *>(header + 1);
+    titles = reinterpret_cast<const DumpIndexTitleEntry *>(entries + entry_count);
+}
+
+DumpIndex::~DumpIndex() {
+    munmap(map, map_size);
+}
+
+const DumpIndexEntry *DumpIndex::find_page(int64_t id) const {
+    const DumpIndexEntry *end = entries + entry_count;
+    const DumpIndexEntry *it = std::lower_bound(entries, end, id,
+        [](const DumpIndexEntry &e, int64_t id) { return e.page_id < id; });
+
+    if (it == end || it->page_id != id) {
+        return nullptr;
+    }
+    return it;
+}
+
+const DumpIndexEntry *DumpIndex::find_title(const std::string &title) const {
+    uint64_t hash = dump_title_hash(title);
+    const DumpIndexTitleEntry *end = titles + entry_count;
+    const DumpIndexTitleEntry *it = std::lower_bound(titles, end, hash,
+        [](const DumpIndexTitleEntry &e, uint64_t hash) { return e.title_hash < hash; });
+
+    if (it == end || it->title_hash != hash) {
+        return nullptr;
+    }
+    return &entries[it->entry];
+}
+
+DumpIndex_u open_dump_index(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(DumpIndexHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+
+    const DumpIndexHeader *header = static_cast<const DumpIndexHeader *>(map);
+    size_t expected = sizeof(DumpIndexHeader) + header->entry_count *
+        (sizeof(DumpIndexEntry) + sizeof(DumpIndexTitleEntry));
+    if (memcmp(header->magic, index_magic, sizeof(index_magic)) ||
+            expected != static_cast<size_t>(st.st_size)) {
+        munmap(map, st.st_size);
+        return nullptr;
+    }
+
+    return DumpIndex_u(new DumpIndex(map, st.st_size));
+}
+
+/*************************** Index building ***************************/
+bool build_dump_index(const char *dump_path, const char *index_path) {
+    std::unique_ptr<XMLDumpParser> parser;
+    try {
+        parser.reset(new XMLDumpParser(dump_path, Streaming));
+    } catch (const XMLDumpError &) {
+        return false;
+    }
+    parser->keep_restart_points();
+
+    std::vector<DumpIndexEntry> entries;
+    try {
+        for (MediaWikiPage_s page = parser->next_page(); page; page = parser->next_page()) {
+            DumpRestartPoint restart = parser->restart_point_for(page->get_offset());
+            entries.push_back({
+                page->get_id(),
+                dump_title_hash(page->get_title()),
+                restart.compressed_offset,
+                restart.uncompressed_offset,
+                page->get_offset()
+            });
+        }
+    } catch (const XMLDumpError &e) {
+        std::cerr << dump_path << ": " << e.what() << std::endl;
+        return false;
+    }
+
+    bool seekable = std::any_of(entries.begin(), entries.end(),
+        [](const DumpIndexEntry &e) { return e.restart_uncompressed_offset != 0; });
+    if (!seekable && entries.size() > 1) {
+        std::cerr << "Warning: " << dump_path << " has no restart points, so every "
+                  << "lookup will decompress it from the beginning" << std::endl;
+    }
+
+    std::stable_sort(entries.begin(), entries.end(),
+        [](const DumpIndexEntry &a, const DumpIndexEntry &b) { return a.page_id < b.page_id; });
+
+    std::vector<DumpIndexTitleEntry> titles(entries.size());
+    for (uint64_t i = 0; i < entries.size(); i++) {
+        titles[i] = {entries[i].title_hash, i};
+    }
+    std::sort(titles.begin(), titles.end(),
+        [](const DumpIndexTitleEntry &a, const DumpIndexTitleEntry &b) {
+            return a.title_hash < b.title_hash ||
+                   (a.title_hash == b.title_hash && a.entry < b.entry);
+        });
+
+    // Only truncate an existing index once the new one is complete
+    std::ofstream out{index_path, std::ofstream::binary};
+    if (!out) {
+        return false;
+    }
+
+    DumpIndexHeader header;
+    memcpy(header.magic, index_magic, sizeof(index_magic));
+    header.entry_count = entries.size();
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(entries.data()),
+              entries.size() * sizeof(DumpIndexEntry));
+    out.write(reinterpret_cast<const char *>(titles.data()),
+              titles.size() * sizeof(DumpIndexTitleEntry));
+
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,97 @@
+#ifndef __DUMPINDEX_HH
+#define __DUMPINDEX_HH
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "CompressedDumpReader.hh"
+
+/**
+ * The index is a sidecar file which lets one open an XML dump at an arbitrary
+ * page.  It consists of a header, the entries sorted by page ID, and the
+ * (title hash, entry number) pairs sorted by the hash.  Everything is stored
+ * in host byte order so that the file can be used directly through mmap().
+ *
+ * Opening a page is only cheap if the dump has restart points near it.  For
+ * a single-member gzip or single-stream bzip2 file every entry points at the
+ * beginning of the dump, and reaching a page means decompressing everything
+ * before it; recompress such dumps with multiple streams to index them.
+ */
+
+struct DumpIndexHeader {
+    char magic[8];
+    uint64_t entry_count;
+};
+
+struct DumpIndexEntry {
+    int64_t page_id;
+    uint64_t title_hash;
+    uint64_t restart_compressed_offset;
+    uint64_t restart_uncompressed_offset;
+    // Offset of the <page> tag within the uncompressed dump
+    uint64_t offset;
+
+    inline DumpRestartPoint restart_point() const {
+        return {restart_compressed_offset, restart_uncompressed_offset};
+    }
+};
+
+struct DumpIndexTitleEntry {
+    uint64_t title_hash;
+    uint64_t entry;
+};
+
+/**
+ * 64-bit FNV-1a hash of the title as it appears in the dump.
+ */
+uint64_t dump_title_hash(const std::string &title);
+
+class DumpIndex {
+  private:
+    void *map;
+    size_t map_size;
+
+    const DumpIndexEntry *entries;
+    const DumpIndexTitleEntry *titles;
+    uint64_t entry_count;
+
+  public:
+    DumpIndex(void *map, size_t map_size);
+    DumpIndex(DumpIndex const&) = delete;
+    ~DumpIndex();
+
+    inline uint64_t size() const { return entry_count; }
+    inline const DumpIndexEntry &operator[](uint64_t i) const { return entries[i]; }
+
+    /**
+     * Returns the entry for the page with the specified ID, or nullptr if
+     * there is none.
+     */
+    const DumpIndexEntry *find_page(int64_t id) const;
+
+    /**
+     * Returns the entry for the page with the specified title, or nullptr if
+     * there is none.  Only the hashes are compared, so the caller should check
+     * the title of the page it gets if a collision would matter.
+     */
+    const DumpIndexEntry *find_title(const std::string &title) const;
+};
+
+typedef std::unique_ptr<DumpIndex> DumpIndex_u;
+
+/**
+ * Maps the index file into memory.  Returns nullptr if the file cannot be
+ * opened or is not an index.
+ */
+DumpIndex_u open_dump_index(const char *path);
+
+/**
+ * Reads through the entire XML dump once and writes the index for it.
+ * Returns false if either file cannot be opened or written, or if the dump
+ * turns out to be damaged.  Warns on stderr if the dump turned out to have
+ * no restart point but its beginning.
+ */
+bool build_dump_index(const char *dump_path, const char *index_path);
+
+#endif /* __DUMPINDEX_HH */
@@ -0,0 +1,486 @@
+#include "DumpInput.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ThreadPool.hh"
+
+// O_DIRECT requires the buffers, offsets and sizes to be aligned to the
+// logical block size; the page size covers every device we care about.
+#define IO_ALIGNMENT 4096
+
+DumpInputOptions &default_dump_input_options() {
+    static DumpInputOptions options = [] {
+        DumpInputOptions result;
+
+        if (const char *backend = getenv("MWDUMP_IO_BACKEND")) {
+            std::string name(backend);
+            if (name == "sync") {
+                result.backend = DumpInputOptions::Synchronous;
+            } else if (name == "threads") {
+                result.backend = DumpInputOptions::Threads;
+            } else if (name == "uring") {
+                result.backend = DumpInputOptions::Uring;
+            }
+        }
+        if (const char *size = getenv("MWDUMP_IO_CHUNK_SIZE")) {
+            result.chunk_size = strtoull(size, nullptr, 10);
+        }
+        if (const char *depth = getenv("MWDUMP_IO_QUEUE_DEPTH")) {
+            result.queue_depth = std::max(1ul, strtoul(depth, nullptr, 10));
+        }
+        if (const char *direct = getenv("MWDUMP_IO_DIRECT")) {
+            result.direct = strcmp(direct, "0") != 0;
+        }
+        if (const char *threads = getenv("MWDUMP_DECODER_THREADS")) {
+            result.decoder_threads = strtoul(threads, nullptr, 10);
+        }
+
+        return result;
+    }();
+    return options;
+}
+
+/**
+ * Splits the file into chunks and keeps up to queue_depth of them in flight,
+ * each one in its own buffer ("slot").  Chunk k always goes into slot
+ * k % queue_depth, and the slot is resubmitted for chunk k + queue_depth once
+ * the consumer is done with chunk k.  The subclasses only provide the way to
+ * start a read and to wait for it.
+ */
+class ChunkedDumpInput : public DumpInput {
+  private:
+    std::vector<char *> buffers;
+    // Chunk which next() returns next, and the one it has returned last
+    uint64_t current = 0;
+    bool returned = false;
+    bool error = false;
+
+    void submit_chunk(uint64_t chunk) {
+        uint64_t offset = base + chunk * chunk_size;
+        if (offset < file_size) {
+            size_t len = std::min<uint64_t>(chunk_size, file_size - offset);
+            submit(chunk % buffers.size(), buffers[chunk % buffers.size()], len, offset);
+        }
+    }
+
+    void release() {
+        for (char *buffer : buffers) {
+            free(buffer);
+        }
+        buffers.clear();
+        if (plain_fd != fd && plain_fd >= 0) {
+            close(plain_fd);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+  protected:
+    int fd = -1;
+    // Descriptor without O_DIRECT for the reads which cannot use it
+    int plain_fd = -1;
+    uint64_t file_size = 0;
+    size_t chunk_size;
+    // The reads start at an aligned offset below the one we were asked for
+    uint64_t base;
+    size_t skip;
+
+    virtual void submit(size_t slot, char *buffer, size_t len, uint64_t offset) = 0;
+    /**
+     * Waits for the read in the slot to complete and returns the number of
+     * bytes read or a negative errno.
+     */
+    virtual ssize_t wait(size_t slot) = 0;
+
+    /**
+     * Submits the first reads; called by the subclasses once they are ready.
+     */
+    void start() {
+        for (uint64_t chunk = 0; chunk < buffers.size(); chunk++) {
+            submit_chunk(chunk);
+        }
+    }
+
+  public:
+    ChunkedDumpInput(int _fd, int _plain_fd, uint64_t offset, const DumpInputOptions &options,
+                     unsigned slots) {
+        fd = _fd;
+        plain_fd = _plain_fd;
+        chunk_size = (std::max<size_t>(options.chunk_size, 1) + IO_ALIGNMENT - 1) &
+                     ~static_cast<size_t>(IO_ALIGNMENT - 1);
+        base = offset & ~static_cast<uint64_t>(IO_ALIGNMENT - 1);
+        skip = offset - base;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            file_size = st.st_size;
+        }
+
+        for (unsigned i = 0; i < slots; i++) {
+            void *buffer = nullptr;
+            if (posix_memalign(&buffer, IO_ALIGNMENT, chunk_size) != 0) {
+                // The destructor does not run for a constructor which throws
+                release();
+                throw std::bad_alloc();
+            }
+            buffers.push_back(static_cast<char *>(buffer));
+        }
+    }
+
+    virtual ~ChunkedDumpInput() {
+        // The subclasses have already waited for the reads still in flight
+        release();
+    }
+
+    /**
+     * Waits for every read that has been submitted but not consumed.
+     */
+    void drain() {
+        // The slot of the chunk returned last is not in flight
+        uint64_t last = current + buffers.size() - (returned ? 1 : 0);
+        for (uint64_t chunk = current; chunk < last; chunk++) {
+            if (base + chunk * chunk_size < file_size) {
+                wait(chunk % buffers.size());
+            }
+        }
+    }
+
+    virtual bool next(const char *&data, size_t &len) override {
+        // The consumer is done with the previous chunk, so its slot is free
+        if (returned) {
+            submit_chunk(current - 1 + buffers.size());
+            returned = false;
+        }
+
+        uint64_t offset = base + current * chunk_size;
+        if (error || offset >= file_size) {
+            return false;
+        }
+
+        size_t slot = current % buffers.size();
+        size_t expected = std::min<uint64_t>(chunk_size, file_size - offset);
+        ssize_t read = wait(slot);
+
+        // Short reads and reads the backend failed to do, e.g. because
+        // the filesystem rejects O_DIRECT, are completed synchronously
+        if (read < 0) {
+            read = 0;
+        }
+        while (static_cast<size_t>(read) < expected) {
+            ssize_t more = pread(plain_fd, buffers[slot] + read, expected - read, offset + read);
+            if (more <= 0) {
+                error = more < 0;
+                // The file has shrunk since we opened it
+                file_size = offset + read;
+                break;
+            }
+            read += more;
+        }
+
+        size_t start = current == 0 ? skip : 0;
+        if (static_cast<size_t>(read) <= start) {
+            return false;
+        }
+
+        data = buffers[slot] + start;
+        len = read - start;
+        current++;
+        returned = true;
+        return true;
+    }
+
+    virtual bool failed() const override { return error; }
+};
+
+/*************************** Synchronous ***************************/
+class SyncDumpInput : public ChunkedDumpInput {
+  private:
+    struct Request {
+        char *buffer;
+        size_t len;
+        uint64_t offset;
+    };
+    Request request;
+
+  protected:
+    virtual void submit(size_t, char *buffer, size_t len, uint64_t offset) override {
+        request = {buffer, len, offset};
+    }
+
+    virtual ssize_t wait(size_t) override {
+        ssize_t read = pread(fd, request.buffer, request.len, request.offset);
+        return read < 0 ? -errno : read;
+    }
+
+  public:
+    SyncDumpInput(int fd, int plain_fd, uint64_t offset, const DumpInputOptions &options)
+            : ChunkedDumpInput(fd, plain_fd, offset, options, 1) {
+        start();
+    }
+};
+
+/*************************** Thread pool ***************************/
+class ThreadedDumpInput : public ChunkedDumpInput {
+  private:
+    struct Slot {
+        bool done = true;
+        ssize_t result = 0;
+    };
+
+    std::mutex lock;
+    std::condition_variable completed;
+    std::vector<Slot> slots;
+    ThreadPool pool;
+
+  protected:
+    virtual void submit(size_t slot, char *buffer, size_t len, uint64_t offset) override {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            slots[slot].done = false;
+        }
+
+        pool.submit([this, slot, buffer, len, offset] {
+            ssize_t read = pread(fd, buffer, len, offset);
+            ssize_t result = read < 0 ? -errno : read;
+
+            std::unique_lock<std::mutex> guard(lock);
+            slots[slot].result = result;
+            slots[slot].done = true;
+            completed.notify_all();
+        });
+    }
+
+    virtual ssize_t wait(size_t slot) override {
+        std::unique_lock<std::mutex> guard(lock);
+        completed.wait(guard, [this, slot] { return slots[slot].done; });
+        return slots[slot].result;
+    }
+
+  public:
+    ThreadedDumpInput(int fd, int plain_fd, uint64_t offset, const DumpInputOptions &options)
+            : ChunkedDumpInput(fd, plain_fd, offset, options, options.queue_depth),
+              slots(options.queue_depth), pool(options.queue_depth) {
+        start();
+    }
+
+    virtual ~ThreadedDumpInput() {
+        pool.wait();
+    }
+};
+
+/*************************** io_uring ***************************/
+/**
+ * Uses the raw system calls, so that we do not depend on liburing.  There is
+ * exactly one thread submitting and reaping, which keeps the ring handling
+ * down to a couple of memory barriers.
+ */
+class UringDumpInput : public ChunkedDumpInput {
+  private:
+    struct Slot {
+        bool done = true;
+        ssize_t result = 0;
+    };
+
+    int ring_fd = -1;
+    std::vector<Slot> slots;
+
+    void *sq_map = MAP_FAILED;
+    size_t sq_map_size = 0;
+    void *cq_map = MAP_FAILED;
+    size_t cq_map_size = 0;
+    struct io_uring_sqe *sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+    size_t sqes_size = 0;
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    void reap() {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            enter(0, 1, IORING_ENTER_GETEVENTS);
+            return;
+        }
+
+        for (; head != tail; head++) {
+            const struct io_uring_cqe &cqe = cqes[head & *cq_mask];
+            slots[cqe.user_data].result = cqe.res;
+            slots[cqe.user_data].done = true;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  protected:
+    virtual void submit(size_t slot, char *buffer, size_t len, uint64_t offset) override {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(buffer);
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = slot;
+
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        slots[slot].done = false;
+
+        if (enter(1, 0, 0) < 0) {
+            // Let next() read it synchronously
+            slots[slot].result = -errno;
+            slots[slot].done = true;
+        }
+    }
+
+    virtual ssize_t wait(size_t slot) override {
+        while (!slots[slot].done) {
+            reap();
+        }
+        return slots[slot].result;
+    }
+
+  public:
+    UringDumpInput(int fd, int plain_fd, uint64_t offset, const DumpInputOptions &options)
+            : ChunkedDumpInput(fd, plain_fd, offset, options, options.queue_depth),
+              slots(options.queue_depth) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, options.queue_depth, &params);
+        if (ring_fd < 0) {
+            return;
+        }
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+        }
+
+        sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+        if (sq_map == MAP_FAILED) {
+            return;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_map = sq_map;
+        } else {
+            cq_map = mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd, IORING_OFF_CQ_RING);
+            if (cq_map == MAP_FAILED) {
+                return;
+            }
+        }
+
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, sqes_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            return;
+        }
+
+        char *sq = static_cast<char *>(sq_map);
+        char *cq = static_cast<char *>(cq_map);
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        start();
+    }
+
+    virtual ~UringDumpInput() {
+        if (valid()) {
+            drain();
+        }
+
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_map != MAP_FAILED && cq_map != sq_map) {
+            munmap(cq_map, cq_map_size);
+        }
+        if (sq_map != MAP_FAILED) {
+            munmap(sq_map, sq_map_size);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+    }
+
+    bool valid() const { return sqes != MAP_FAILED; }
+
+    /**
+     * Hands the descriptors over to another backend if the ring could not be
+     * set up.
+     */
+    void release_descriptors() {
+        fd = -1;
+        plain_fd = -1;
+    }
+};
+
+DumpInput_u open_dump_input(const char *path, uint64_t offset, const DumpInputOptions &options) {
+    int plain_fd = open(path, O_RDONLY);
+    if (plain_fd < 0) {
+        return nullptr;
+    }
+
+    int fd = plain_fd;
+    if (options.direct) {
+        fd = open(path, O_RDONLY | O_DIRECT);
+        if (fd < 0) {
+            fd = plain_fd;
+        }
+    }
+
+    DumpInputOptions::Backend backend = options.backend;
+    if (backend == DumpInputOptions::Auto || backend == DumpInputOptions::Uring) {
+        UringDumpInput *input = new UringDumpInput(fd, plain_fd, offset, options);
+        if (input->valid()) {
+            return DumpInput_u(input);
+        }
+
+        // io_uring is unavailable or forbidden, so fall back to the threads
+        input->release_descriptors();
+        delete input;
+        backend = DumpInputOptions::Threads;
+    }
+
+    if (backend == DumpInputOptions::Threads && options.queue_depth > 1) {
+        return DumpInput_u(new ThreadedDumpInput(fd, plain_fd, offset, options));
+    }
+
+    return DumpInput_u(new SyncDumpInput(fd, plain_fd, offset, options));
+}
@@ -0,0 +1,70 @@
+#ifndef __DUMPINPUT_HH
+#define __DUMPINPUT_HH
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+
+/**
+ * The way the compressed bytes of a dump are read from the disk.  Every
+ * backend except Synchronous keeps several large reads in flight, so that
+ * the decompressors normally find the next chunk already in memory.
+ */
+struct DumpInputOptions {
+    enum Backend {
+        // io_uring if the kernel allows it, a thread pool otherwise
+        Auto,
+        Synchronous,
+        Threads,
+        Uring
+    };
+
+    Backend backend = Auto;
+    // Size of a single read; rounded up to a multiple of the page size
+    size_t chunk_size = 4 * 1024 * 1024;
+    // Number of reads in flight
+    unsigned queue_depth = 8;
+    // Bypass the page cache with O_DIRECT where the filesystem allows it
+    bool direct = false;
+    // Threads decompressing the formats which can be decompressed in
+    // parallel (xz and zstd); zero means one per core
+    unsigned decoder_threads = 0;
+};
+
+/**
+ * The options open_compressed_dump() uses unless told otherwise.  They are
+ * initialized from the MWDUMP_IO_BACKEND (auto, sync, threads or uring),
+ * MWDUMP_IO_CHUNK_SIZE, MWDUMP_IO_QUEUE_DEPTH, MWDUMP_IO_DIRECT and
+ * MWDUMP_DECODER_THREADS environment variables, and can be changed before
+ * opening any dumps.
+ */
+DumpInputOptions &default_dump_input_options();
+
+class DumpInput {
+  public:
+    /**
+     * Returns the next piece of the file.  The data stays valid until the
+     * next call.  Returns false at the end of the file or on error.
+     */
+    virtual bool next(const char *&data, size_t &len) = 0;
+
+    /**
+     * Whether the last call to next() returned false because of an error.
+     */
+    virtual bool failed() const = 0;
+
+    DumpInput() {}
+    DumpInput(DumpInput const&) = delete;
+    virtual ~DumpInput() {}
+};
+
+typedef std::unique_ptr<DumpInput> DumpInput_u;
+
+/**
+ * Opens the file for reading starting at the specified offset.  Returns
+ * nullptr if the file cannot be opened.
+ */
+DumpInput_u open_dump_input(const char *path, uint64_t offset,
+                            const DumpInputOptions &options = default_dump_input_options());
+
+#endif /* __DUMPINPUT_HH */
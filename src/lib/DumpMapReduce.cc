@@ -0,0 +1,476 @@
+#include "DumpMapReduce.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "CompressedDumpReader.hh"
+#include "DumpInput.hh"
+
+#define SCAN_CHUNK_SIZE (64 * 1024)
+
+/**
+ * A single-producer single-consumer queue of length-prefixed records.  Both
+ * positions only ever grow, and are reduced modulo the capacity when used.
+ */
+struct SharedRing {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) uint64_t capacity;
+
+    inline char *data() { return reinterpret_cast<char *>(this + 1); }
+
+    void copy_in(uint64_t position, const void *src, size_t len) {
+        size_t start = position & (capacity - 1);
+        size_t first = std::min<size_t>(len, capacity - start);
+        memcpy(data() + start, src, first);
+        memcpy(data(), static_cast<const char *>(src) + first, len - first);
+    }
+
+    void copy_out(uint64_t position, void *dst, size_t len) {
+        size_t start = position & (capacity - 1);
+        size_t first = std::min<size_t>(len, capacity - start);
+        memcpy(dst, data() + start, first);
+        memcpy(static_cast<char *>(dst) + first, data(), len - first);
+    }
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the ring positions are shared between processes");
+
+// Spins for a little while, then yields, then sleeps
+static void back_off(unsigned &attempt) {
+    attempt++;
+    if (attempt < 64) {
+        return;
+    }
+    if (attempt < 256) {
+        sched_yield();
+        return;
+    }
+    struct timespec delay = {0, 50 * 1000};
+    nanosleep(&delay, nullptr);
+}
+
+static SharedRing *create_ring(size_t capacity) {
+    assert((capacity & (capacity - 1)) == 0);
+
+    // Mapped before the fork, so both processes see the same pages
+    void *map = mmap(nullptr, sizeof(SharedRing) + capacity, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+
+    SharedRing *ring = new (map) SharedRing();
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->capacity = capacity;
+    return ring;
+}
+
+static void destroy_ring(SharedRing *ring) {
+    size_t size = sizeof(SharedRing) + ring->capacity;
+    ring->~SharedRing();
+    munmap(ring, size);
+}
+
+/*************************** MapOutput ***************************/
+MapOutput::MapOutput(SharedRing *_ring, uint64_t _skip) {
+    ring = _ring;
+    skip = _skip;
+}
+
+void MapOutput::emit(std::string_view record) {
+    // The parent already has the records up to where the previous attempt
+    // at the shard crashed
+    if (emitted++ < skip) {
+        return;
+    }
+
+    uint32_t len = record.size();
+    uint64_t needed = sizeof(len) + record.size();
+    if (record.size() > UINT32_MAX || needed > ring->capacity) {
+        throw std::length_error("record of " + std::to_string(record.size()) +
+                                " bytes does not fit the ring buffer of " +
+                                std::to_string(ring->capacity) + " bytes");
+    }
+
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    unsigned attempt = 0;
+    while (tail + needed - ring->head.load(std::memory_order_acquire) > ring->capacity) {
+        back_off(attempt);
+    }
+
+    ring->copy_in(tail, &len, sizeof(len));
+    ring->copy_in(tail + sizeof(len), record.data(), record.size());
+    ring->tail.store(tail + needed, std::memory_order_release);
+}
+
+/*************************** run_map_reduce ***************************/
+struct WorkerSlot {
+    SharedRing *ring = nullptr;
+    pid_t pid = 0;
+    size_t shard = 0;
+};
+
+/**
+ * The worker slots of a run, which are cleaned up however it ends: should
+ * the reducer throw, the workers still running are killed and reaped before
+ * their rings go away.
+ */
+struct WorkerSlots : std::vector<WorkerSlot> {
+    using std::vector<WorkerSlot>::vector;
+
+    ~WorkerSlots() {
+        for (WorkerSlot &slot : *this) {
+            if (slot.pid != 0) {
+                kill(slot.pid, SIGKILL);
+                waitpid(slot.pid, nullptr, 0);
+            }
+            if (slot.ring) {
+                destroy_ring(slot.ring);
+            }
+        }
+    }
+};
+
+// Passes everything in the ring to the reducer; returns the record count
+static uint64_t drain(WorkerSlot &slot, const ReduceFunction &reduce, std::string &scratch) {
+    SharedRing &ring = *slot.ring;
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    uint64_t records = 0;
+
+    while (head < tail) {
+        uint32_t len;
+        ring.copy_out(head, &len, sizeof(len));
+        uint64_t start = (head + sizeof(len)) & (ring.capacity - 1);
+
+        if (start + len <= ring.capacity) {
+            reduce(slot.shard, std::string_view(ring.data() + start, len));
+        } else {
+            scratch.resize(len);
+            ring.copy_out(head + sizeof(len), &scratch[0], len);
+            reduce(slot.shard, scratch);
+        }
+
+        head += sizeof(len) + len;
+        ring.head.store(head, std::memory_order_release);
+        records++;
+    }
+
+    return records;
+}
+
+size_t run_map_reduce(size_t shard_count, MapFunction map, ReduceFunction reduce,
+                      const MapReduceOptions &options) {
+    unsigned worker_count = options.workers;
+    if (worker_count == 0) {
+        worker_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    worker_count = std::min<size_t>(worker_count, shard_count);
+
+    WorkerSlots slots(worker_count);
+    for (WorkerSlot &slot : slots) {
+        slot.ring = create_ring(options.ring_size);
+        if (!slot.ring) {
+            return shard_count;
+        }
+    }
+
+    std::vector<uint64_t> consumed(shard_count, 0);
+    std::vector<unsigned> attempts(shard_count, 0);
+    std::deque<size_t> pending;
+    for (size_t shard = 0; shard < shard_count; shard++) {
+        pending.push_back(shard);
+    }
+    size_t failed = 0;
+    std::string scratch;
+    pid_t parent = getpid();
+
+    auto give_up_or_retry = [&](size_t shard) {
+        if (attempts[shard] < options.max_attempts) {
+            pending.push_front(shard);
+        } else {
+            std::cerr << "Shard " << shard << " failed " << attempts[shard]
+                      << " times, giving up" << std::endl;
+            failed++;
+        }
+    };
+
+    auto start_next = [&](WorkerSlot &slot) {
+        while (!pending.empty() && slot.pid == 0) {
+            size_t shard = pending.front();
+            pending.pop_front();
+            attempts[shard]++;
+
+            slot.ring->head.store(0);
+            slot.ring->tail.store(0);
+            slot.shard = shard;
+
+            pid_t pid = fork();
+            if (pid == 0) {
+                // Nothing of the parent's, like its stdio buffers, is
+                // to be flushed or destroyed from here, and an exception
+                // must not unwind into the parent's loop
+                int status = 0;
+                // Should the parent die, so does the worker, instead of
+                // mapping on with nobody draining its ring
+                if (prctl(PR_SET_PDEATHSIG, SIGKILL) != 0 || getppid() != parent) {
+                    _exit(1);
+                }
+                try {
+                    MapOutput out(slot.ring, consumed[shard]);
+                    map(shard, out);
+                } catch (const std::exception &e) {
+                    std::cerr << "Worker for shard " << shard << ": " << e.what() << std::endl;
+                    status = 1;
+                } catch (...) {
+                    status = 1;
+                }
+                _exit(status);
+            }
+
+            if (pid < 0) {
+                give_up_or_retry(shard);
+                continue;
+            }
+            slot.pid = pid;
+        }
+    };
+
+    for (WorkerSlot &slot : slots) {
+        start_next(slot);
+    }
+
+    unsigned attempt = 0;
+    for (;;) {
+        bool busy = false;
+        bool progress = false;
+
+        for (WorkerSlot &slot : slots) {
+            if (slot.pid == 0) {
+                continue;
+            }
+            busy = true;
+
+            uint64_t records = drain(slot, reduce, scratch);
+            consumed[slot.shard] += records;
+            progress |= records > 0;
+
+            int status;
+            if (waitpid(slot.pid, &status, WNOHANG) != slot.pid) {
+                continue;
+            }
+
+            // Whatever the worker managed to publish before it exited is
+            // still valid
+            consumed[slot.shard] += drain(slot, reduce, scratch);
+            slot.pid = 0;
+            progress = true;
+
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                std::cerr << "Worker for shard " << slot.shard << " ";
+                if (WIFSIGNALED(status)) {
+                    std::cerr << "killed by signal " << WTERMSIG(status);
+                } else {
+                    std::cerr << "exited with status " << WEXITSTATUS(status);
+                }
+                std::cerr << " after " << consumed[slot.shard] << " records" << std::endl;
+                give_up_or_retry(slot.shard);
+            }
+
+            start_next(slot);
+        }
+
+        if (!busy) {
+            break;
+        }
+        if (progress) {
+            attempt = 0;
+        } else {
+            back_off(attempt);
+        }
+    }
+
+    return failed;
+}
+
+/*************************** XML dumps ***************************/
+std::vector<XMLDumpShard> plan_xml_dump_shards(const DumpIndex &index, size_t shard_count) {
+    // The index is sorted by page ID, which is not necessarily the dump order
+    std::vector<const DumpIndexEntry *> entries;
+    for (uint64_t i = 0; i < index.size(); i++) {
+        entries.push_back(&index[i]);
+    }
+    std::sort(entries.begin(), entries.end(), [](const DumpIndexEntry *a, const DumpIndexEntry *b) {
+        return a->offset < b->offset;
+    });
+
+    std::vector<XMLDumpShard> shards;
+    if (entries.empty() || shard_count == 0) {
+        return shards;
+    }
+
+    // Split evenly by the uncompressed offsets, which is as close to even by
+    // the amount of work as the index gets
+    uint64_t first = entries.front()->offset;
+    uint64_t span = entries.back()->offset - first;
+    size_t i = 0;
+    for (size_t s = 0; s < shard_count && i < entries.size(); s++) {
+        uint64_t target = first + span / shard_count * s;
+        while (i < entries.size() && entries[i]->offset < target) {
+            i++;
+        }
+        if (i == entries.size()) {
+            break;
+        }
+        if (!shards.empty() && shards.back().offset == entries[i]->offset) {
+            continue;
+        }
+        // A shard starting from the same restart point as the previous one
+        // would decompress all of it again just to skip it
+        if (!shards.empty() && shards.back().restart.compressed_offset ==
+                                   entries[i]->restart_compressed_offset) {
+            continue;
+        }
+        shards.push_back({entries[i]->restart_point(), entries[i]->offset, UINT64_MAX});
+    }
+
+    for (size_t s = 0; s + 1 < shards.size(); s++) {
+        shards[s].end_offset = shards[s + 1].offset;
+    }
+    if (shards.size() == 1 && shard_count > 1 && entries.size() > 1) {
+        std::cerr << "Warning: the dump has no restart points after its start, so it is "
+                  << "mapped as a single shard" << std::endl;
+    }
+    return shards;
+}
+
+size_t map_reduce_xml_dump(const char *path, const std::vector<XMLDumpShard> &shards,
+                           XMLMapFunction map, ReduceFunction reduce,
+                           const MapReduceOptions &options) {
+    std::string dump_path(path);
+    XMLDumpParserOptions parser_options = default_xml_dump_parser_options();
+    DumpInputOptions input_options = default_dump_input_options();
+    input_options.decoder_threads = options.decoder_threads;
+    parser_options.input = input_options;
+
+    auto map_shard = [&dump_path, &shards, &map, &parser_options](size_t s, MapOutput &out) {
+        const XMLDumpShard &shard = shards[s];
+        XMLDumpParser parser(dump_path.c_str(), Streaming, shard.restart, shard.offset,
+                             parser_options);
+        for (MediaWikiPage_s page = parser.next_page(); page; page = parser.next_page()) {
+            if (page->get_offset() >= shard.end_offset) {
+                break;
+            }
+            while (MediaWikiRevision_s rev = parser.next_revision()) {
+                map(*rev, out);
+            }
+        }
+    };
+
+    return run_map_reduce(shards.size(), map_shard, reduce, options);
+}
+
+/*************************** SQL dumps ***************************/
+// Returns the offset of the first INSERT statement at or after the offset,
+// or the file size if there is none
+static uint64_t find_statement(int fd, uint64_t offset, uint64_t file_size) {
+    const char target[] = "\nINSERT INTO ";
+    const size_t target_len = sizeof(target) - 1;
+    std::string chunk;
+
+    // The statement starts after the newline, so look for it one byte early
+    uint64_t position = offset > 0 ? offset - 1 : 0;
+    while (position < file_size) {
+        chunk.resize(SCAN_CHUNK_SIZE + target_len);
+        ssize_t got = pread(fd, &chunk[0], chunk.size(), position);
+        if (got <= 0) {
+            break;
+        }
+        chunk.resize(got);
+
+        size_t found = chunk.find(target);
+        if (found != std::string::npos) {
+            return position + found + 1;
+        }
+        if (static_cast<size_t>(got) < target_len) {
+            break;
+        }
+        position += got - target_len + 1;
+    }
+
+    return file_size;
+}
+
+std::vector<SQLDumpShard> plan_sql_dump_shards(const char *path, size_t shard_count) {
+    std::vector<SQLDumpShard> shards;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return shards;
+    }
+
+    const DumpCodec *codec = detect_dump_codec(path);
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    bool uncompressed = codec && !strcmp(codec->name, "sql");
+    if (file_size < 0 || !uncompressed || shard_count <= 1) {
+        close(fd);
+        shards.push_back({0, UINT64_MAX});
+        return shards;
+    }
+
+    // Everything before the first INSERT belongs to the first shard, which
+    // skips it the same way an unsplit parser would
+    uint64_t begin = 0;
+    for (size_t s = 1; s < shard_count; s++) {
+        uint64_t boundary = find_statement(fd, file_size / shard_count * s, file_size);
+        if (boundary <= begin) {
+            continue;
+        }
+        if (boundary >= static_cast<uint64_t>(file_size)) {
+            break;
+        }
+        shards.push_back({begin, boundary});
+        begin = boundary;
+    }
+    shards.push_back({begin, static_cast<uint64_t>(file_size)});
+
+    close(fd);
+    return shards;
+}
+
+size_t map_reduce_sql_dump(const char *path, const std::vector<SQLDumpShard> &shards,
+                           SQLMapFunction map, ReduceFunction reduce,
+                           const MapReduceOptions &options) {
+    std::string dump_path(path);
+    DumpInputOptions input_options = default_dump_input_options();
+    input_options.decoder_threads = options.decoder_threads;
+
+    auto map_shard = [&dump_path, &shards, &map, &input_options](size_t s, MapOutput &out) {
+        SQLDumpParser parser(std::string(dump_path), shards[s].begin, shards[s].end,
+                             input_options);
+        while (SQLRow_u row = parser.get()) {
+            map(*row, out);
+        }
+    };
+
+    return run_map_reduce(shards.size(), map_shard, reduce, options);
+}
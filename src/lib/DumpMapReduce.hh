@@ -0,0 +1,125 @@
+#ifndef __DUMPMAPREDUCE_HH
+#define __DUMPMAPREDUCE_HH
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+#include "DumpIndex.hh"
+#include "SQLDumpParser.hh"
+#include "XMLDumpParser.hh"
+
+/**
+ * Runs a job over a dump in several worker processes instead of threads, so
+ * that the map functions share neither an allocator nor anything else.
+ *
+ * The dump is split into shards.  Each shard is mapped in a forked process,
+ * which passes its records to the parent through a ring buffer in memory
+ * shared between the two.  The parent calls the reduce function for every
+ * record as it arrives, so the records of different shards interleave.
+ *
+ * A worker which crashes, throws or exits with an error is restarted on the same
+ * shard.  The records the parent has already received are not emitted again,
+ * which relies on the map function producing the same records in the same
+ * order every time.
+ */
+
+struct MapReduceOptions {
+    // Worker processes running at a time; zero means one per core
+    unsigned workers = 0;
+    // Size of each ring buffer, a power of two; a record must fit it with
+    // its 4-byte length
+    size_t ring_size = 8 * 1024 * 1024;
+    // Times a shard is attempted before it is given up on
+    unsigned max_attempts = 3;
+    // Threads decompressing the dump in each worker of map_reduce_xml_dump()
+    // and map_reduce_sql_dump(); the workers already keep the cores busy.
+    // Zero means one per core.
+    unsigned decoder_threads = 1;
+};
+
+struct SharedRing;
+
+/**
+ * The output of a map function, writing into the ring buffer of its worker.
+ */
+class MapOutput {
+  private:
+    SharedRing *ring;
+    uint64_t skip;
+    uint64_t emitted = 0;
+
+  public:
+    MapOutput(SharedRing *ring, uint64_t skip);
+    MapOutput(MapOutput const&) = delete;
+
+    /**
+     * Passes the record to the reducer.  Blocks while the ring is full, and
+     * throws std::length_error if the record does not fit it at all.
+     */
+    void emit(std::string_view record);
+};
+
+typedef std::function<void(size_t shard, MapOutput &out)> MapFunction;
+typedef std::function<void(size_t shard, std::string_view record)> ReduceFunction;
+
+/**
+ * Runs the map function on every shard number below shard_count, each in a
+ * worker process, and the reduce function in the calling process.  Returns
+ * the number of shards which failed on every attempt.  If the reduce
+ * function throws, the workers are killed before the exception is passed on.
+ */
+size_t run_map_reduce(size_t shard_count, MapFunction map, ReduceFunction reduce,
+                      const MapReduceOptions &options = MapReduceOptions());
+
+/*************************** XML dumps ***************************/
+struct XMLDumpShard {
+    DumpRestartPoint restart;
+    // Offsets of the first <page> tag of the shard and of the next shard
+    uint64_t offset;
+    uint64_t end_offset;
+};
+
+/**
+ * Splits the dump into at most shard_count runs of pages of about the same
+ * length, at the pages listed in its index.  A shard starts decompressing at
+ * the restart point of its first page, so no two shards share one: a dump
+ * compressed as a single gzip member or bzip2 stream has no restart point
+ * after its start and is always mapped as a single shard.
+ */
+std::vector<XMLDumpShard> plan_xml_dump_shards(const DumpIndex &index, size_t shard_count);
+
+typedef std::function<void(const MediaWikiRevision &rev, MapOutput &out)> XMLMapFunction;
+
+/**
+ * Calls the map function for every revision of the dump.
+ */
+size_t map_reduce_xml_dump(const char *path, const std::vector<XMLDumpShard> &shards,
+                           XMLMapFunction map, ReduceFunction reduce,
+                           const MapReduceOptions &options = MapReduceOptions());
+
+/*************************** SQL dumps ***************************/
+struct SQLDumpShard {
+    uint64_t begin;
+    uint64_t end;
+};
+
+/**
+ * Splits an uncompressed dump into at most shard_count byte ranges at the
+ * INSERT statements.  A compressed dump cannot be entered in the middle, so
+ * it always makes a single shard.  Returns no shards if the dump cannot be
+ * opened.
+ */
+std::vector<SQLDumpShard> plan_sql_dump_shards(const char *path, size_t shard_count);
+
+typedef std::function<void(const SQLRow &row, MapOutput &out)> SQLMapFunction;
+
+/**
+ * Calls the map function for every row of the dump.
+ */
+size_t map_reduce_sql_dump(const char *path, const std::vector<SQLDumpShard> &shards,
+                           SQLMapFunction map, ReduceFunction reduce,
+                           const MapReduceOptions &options = MapReduceOptions());
+
+#endif /* __DUMPMAPREDUCE_HH */
@@ -0,0 +1,103 @@
+#include "NumericParsing.hh"
+
+#include <charconv>
+
+// Every power of ten up to 10^22 is exactly representable as a double
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static inline bool is_digit(char c) {
+    return static_cast<unsigned char>(c - '0') < 10;
+}
+
+const char *numeric_parsing::parse_double_slow(const char *begin, const char *end, double &out) {
+    std::from_chars_result result = std::from_chars(begin, end, out);
+    if (result.ec != std::errc()) {
+        return nullptr;
+    }
+    return result.ptr;
+}
+
+const char *parse_double(const char *begin, const char *end, double &out) {
+    const char *p = begin;
+    bool negative = p < end && *p == '-';
+    p += negative;
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int64_t exponent = 0;
+    bool exact = true;
+    bool any = false;
+
+    for (; p < end && is_digit(*p); p++) {
+        any = true;
+        if (mantissa == 0 && *p == '0') {
+            continue;
+        }
+        if (digits == 19) {
+            exact = false;
+            continue;
+        }
+        mantissa = mantissa * 10 + (*p - '0');
+        digits++;
+    }
+
+    if (p < end && *p == '.') {
+        p++;
+        for (; p < end && is_digit(*p); p++) {
+            any = true;
+            if (mantissa == 0 && *p == '0') {
+                exponent--;
+                continue;
+            }
+            if (digits == 19) {
+                exact = false;
+                continue;
+            }
+            mantissa = mantissa * 10 + (*p - '0');
+            digits++;
+            exponent--;
+        }
+    }
+
+    if (!any) {
+        return nullptr;
+    }
+
+    // The exponent only counts if there are digits after the "e"
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negative_exponent = q < end && *q == '-';
+        if (q < end && (*q == '-' || *q == '+')) {
+            q++;
+        }
+
+        int64_t value = 0;
+        const char *digits_start = q;
+        for (; q < end && is_digit(*q); q++) {
+            if (value < 100000) {
+                value = value * 10 + (*q - '0');
+            }
+        }
+
+        if (q > digits_start) {
+            exponent += negative_exponent ? -value : value;
+            p = q;
+        }
+    }
+
+    if (exact && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        double value = static_cast<double>(mantissa);
+        if (exponent < 0) {
+            value /= powers_of_ten[-exponent];
+        } else {
+            value *= powers_of_ten[exponent];
+        }
+        out = negative ? -value : value;
+        return p;
+    }
+
+    return numeric_parsing::parse_double_slow(begin, p, out);
+}
@@ -0,0 +1,124 @@
+#ifndef __NUMERICPARSING_HH
+#define __NUMERICPARSING_HH
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+/**
+ * Decimal number parsing straight from the input, shared by the SQL and XML
+ * parsers.  Numbers are the bulk of the link table dumps, so the integers are
+ * converted eight digits at a time within a 64-bit register (SWAR).
+ *
+ * All functions parse a number at the beginning of [begin, end) and return
+ * the pointer past its last character, or nullptr if there is no number there
+ * or it does not fit the type.  Leading whitespace is not skipped.
+ */
+
+namespace numeric_parsing {
+    // True if all eight bytes of the little-endian word are ASCII digits
+    inline bool is_eight_digits(uint64_t word) {
+        return ((word & 0xf0f0f0f0f0f0f0f0ULL) |
+                (((word + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) ==
+               0x3333333333333333ULL;
+    }
+
+    // Converts eight ASCII digits, the first one in the lowest byte
+    inline uint32_t parse_eight_digits(uint64_t word) {
+        const uint64_t mask = 0x000000ff000000ffULL;
+        const uint64_t mul1 = 0x000f424000000064ULL;  // 100 + (1000000 << 32)
+        const uint64_t mul2 = 0x0000271000000001ULL;  // 1 + (10000 << 32)
+        word -= 0x3030303030303030ULL;
+        word = (word * 10) + (word >> 8);
+        return static_cast<uint32_t>(
+            (((word & mask) * mul1) + (((word >> 16) & mask) * mul2)) >> 32);
+    }
+
+    /**
+     * Parses the digits into value.  Returns the end of the digits, or
+     * nullptr if there are none or the value does not fit 64 bits.
+     */
+    inline const char *parse_digits(const char *p, const char *end, uint64_t &value) {
+        const char *start = p;
+        uint64_t result = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        // Two rounds cover 16 of the at most 20 digits of a 64-bit number
+        // without any risk of overflow
+        for (int round = 0; round < 2 && end - p >= 8; round++) {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            if (!is_eight_digits(word)) {
+                break;
+            }
+            result = result * 100000000 + parse_eight_digits(word);
+            p += 8;
+        }
+#endif
+
+        for (; p < end && static_cast<unsigned char>(*p - '0') < 10; p++) {
+            uint64_t digit = *p - '0';
+            if (p - start >= 19 &&
+                    (__builtin_mul_overflow(result, 10, &result) ||
+                     __builtin_add_overflow(result, digit, &result))) {
+                return nullptr;
+            }
+            if (p - start < 19) {
+                result = result * 10 + digit;
+            }
+        }
+
+        if (p == start) {
+            return nullptr;
+        }
+
+        value = result;
+        return p;
+    }
+
+    const char *parse_double_slow(const char *begin, const char *end, double &out);
+}
+
+template <typename T>
+inline const char *parse_integer(const char *begin, const char *end, T &out) {
+    static_assert(std::is_integral<T>::value, "parse_integer() is for integers");
+
+    bool negative = begin < end && *begin == '-';
+    if (negative && !std::is_signed<T>::value) {
+        return nullptr;
+    }
+
+    uint64_t magnitude;
+    const char *p = numeric_parsing::parse_digits(begin + negative, end, magnitude);
+    if (!p) {
+        return nullptr;
+    }
+
+    typedef typename std::make_unsigned<T>::type U;
+    if (negative) {
+        // The magnitude of the minimum is one more than that of the maximum
+        uint64_t limit = static_cast<uint64_t>(std::numeric_limits<T>::max()) + 1;
+        if (magnitude > limit) {
+            return nullptr;
+        }
+        out = static_cast<T>(static_cast<U>(0) - static_cast<U>(magnitude));
+    } else {
+        if (magnitude > static_cast<uint64_t>(std::numeric_limits<T>::max())) {
+            return nullptr;
+        }
+        out = static_cast<T>(magnitude);
+    }
+
+    return p;
+}
+
+/**
+ * Parses a floating point number in the [-]digits[.digits][(e|E)[+|-]digits]
+ * form with correct rounding.  The common case of at most 19 significant
+ * digits and a small exponent is handled exactly with a single floating point
+ * operation (Clinger's fast path); everything else goes to std::from_chars.
+ */
+const char *parse_double(const char *begin, const char *end, double &out);
+
+#endif /* __NUMERICPARSING_HH */
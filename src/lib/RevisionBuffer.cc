@@ -0,0 +1,148 @@
+#include "RevisionBuffer.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <unistd.h>
+
+// Encoding of the spilled revisions: the fixed-width fields followed by the
+// length-prefixed strings.
+static void put_string(std::string &out, const std::string &str) {
+    uint64_t len = str.size();
+    out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    out.append(str);
+}
+
+static bool get_string(const char *&pos, const char *end, std::string &str) {
+    uint64_t len;
+    if (static_cast<size_t>(end - pos) < sizeof(len)) {
+        return false;
+    }
+    memcpy(&len, pos, sizeof(len));
+    pos += sizeof(len);
+    if (static_cast<uint64_t>(end - pos) < len) {
+        return false;
+    }
+    str.assign(pos, len);
+    pos += len;
+    return true;
+}
+
+SpillingRevisionBuffer::SpillingRevisionBuffer(MediaWikiPage_s _page, size_t _memory_budget) {
+    page = _page;
+    memory_budget = _memory_budget;
+}
+
+SpillingRevisionBuffer::~SpillingRevisionBuffer() {
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+size_t SpillingRevisionBuffer::footprint(const MediaWikiRevision &rev) {
+    return sizeof(MediaWikiRevision) + rev.timestamp.size() + rev.author_name.size() +
+           rev.author_ip.size() + rev.comment.size() + rev.text.size();
+}
+
+void SpillingRevisionBuffer::spill(size_t i) {
+    if (!file) {
+        // tmpfile() files are gone as soon as they are closed
+        file = tmpfile();
+        if (!file) {
+            throw std::system_error(errno, std::generic_category(), "cannot create spill file");
+        }
+    }
+
+    const MediaWikiRevision &rev = *entries[i].revision;
+    std::string encoded;
+    encoded.append(reinterpret_cast<const char *>(&rev.id), sizeof(rev.id));
+    encoded.append(reinterpret_cast<const char *>(&rev.author_id), sizeof(rev.author_id));
+    encoded.push_back(rev.text_stub);
+    put_string(encoded, rev.timestamp);
+    put_string(encoded, rev.author_name);
+    put_string(encoded, rev.author_ip);
+    put_string(encoded, rev.comment);
+    put_string(encoded, rev.text);
+
+    for (size_t done = 0; done < encoded.size();) {
+        ssize_t written = pwrite(fileno(file), encoded.data() + done, encoded.size() - done,
+                                 file_size + done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            // Short of space, most likely; the revision simply stays resident
+            throw std::system_error(written < 0 ? errno : ENOSPC, std::generic_category(),
+                                    "cannot write spill file");
+        }
+        done += written;
+    }
+
+    entries[i].offset = file_size;
+    entries[i].length = encoded.size();
+    file_size += encoded.size();
+
+    memory_used -= footprint(rev);
+    entries[i].revision = nullptr;
+}
+
+void SpillingRevisionBuffer::push_back(MediaWikiRevision_s rev) {
+    memory_used += footprint(*rev);
+    entries.push_back({rev, 0, 0});
+    resident.push_back(entries.size() - 1);
+
+    // The newest revision stays in memory even if it alone is over budget,
+    // since the caller holds it anyways
+    while (memory_used > memory_budget && resident.size() > 1) {
+        spill(resident.front());
+        resident.pop_front();
+    }
+}
+
+MediaWikiRevision_s SpillingRevisionBuffer::operator[](size_t i) const {
+    const Entry &entry = entries[i];
+    if (entry.revision) {
+        return entry.revision;
+    }
+
+    std::vector<char> encoded(entry.length);
+    for (size_t done = 0; done < entry.length;) {
+        ssize_t read = pread(fileno(file), encoded.data() + done, entry.length - done,
+                             entry.offset + done);
+        if (read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read <= 0) {
+            throw std::system_error(read < 0 ? errno : EIO, std::generic_category(),
+                                    "cannot read spill file");
+        }
+        done += read;
+    }
+
+    MediaWikiRevision_s rev(new MediaWikiRevision());
+    const char *pos = encoded.data();
+    const char *end = pos + encoded.size();
+    bool ok = encoded.size() >= sizeof(rev->id) + sizeof(rev->author_id) + 1;
+    if (ok) {
+        memcpy(&rev->id, pos, sizeof(rev->id));
+        pos += sizeof(rev->id);
+        memcpy(&rev->author_id, pos, sizeof(rev->author_id));
+        pos += sizeof(rev->author_id);
+        rev->text_stub = *pos++ != 0;
+    }
+
+    ok = ok && get_string(pos, end, rev->timestamp) &&
+         get_string(pos, end, rev->author_name) &&
+         get_string(pos, end, rev->author_ip) &&
+         get_string(pos, end, rev->comment) &&
+         get_string(pos, end, rev->text) &&
+         pos == end;
+    if (!ok) {
+        throw std::system_error(EIO, std::generic_category(), "corrupt record in spill file");
+    }
+
+    rev->page = page;
+    return rev;
+}
@@ -0,0 +1,76 @@
+#ifndef __REVISIONBUFFER_HH
+#define __REVISIONBUFFER_HH
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <vector>
+
+#include "XMLDumpParser.hh"
+
+/**
+ * Random-access storage for the revisions of one page which keeps at most
+ * memory_budget bytes of them in memory.  Once the budget is exceeded, the
+ * oldest revisions are written out to an anonymous temporary file and read
+ * back from it on every access.
+ *
+ * Typical use, together with the Streaming mode of XMLDumpParser:
+ *
+ *     for (MediaWikiPage_s page = parser.next_page(); page; page = parser.next_page()) {
+ *         SpillingRevisionBuffer revisions(page, 256 * 1024 * 1024);
+ *         while (MediaWikiRevision_s rev = parser.next_revision()) {
+ *             revisions.push_back(rev);
+ *         }
+ *         ...
+ *     }
+ */
+class SpillingRevisionBuffer {
+  private:
+    struct Entry {
+        // Null once the revision has been spilled
+        MediaWikiRevision_s revision;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    MediaWikiPage_s page;
+    size_t memory_budget;
+    size_t memory_used = 0;
+
+    std::vector<Entry> entries;
+    // Entries which are still in memory, oldest first
+    std::deque<size_t> resident;
+
+    FILE *file = nullptr;
+    uint64_t file_size = 0;
+
+    static size_t footprint(const MediaWikiRevision &rev);
+    void spill(size_t i);
+
+  public:
+    SpillingRevisionBuffer(MediaWikiPage_s page, size_t memory_budget);
+    SpillingRevisionBuffer(SpillingRevisionBuffer const&) = delete;
+    ~SpillingRevisionBuffer();
+
+    inline size_t size() const { return entries.size(); }
+    inline MediaWikiPage_s get_page() const { return page; }
+    inline bool has_spilled() const { return file != nullptr; }
+
+    /**
+     * Adds the revision, spilling the oldest ones if over budget.  Throws
+     * std::system_error if the temporary file cannot be created or written,
+     * in which case nothing is lost, but the buffer stays over budget.
+     */
+    void push_back(MediaWikiRevision_s rev);
+
+    /**
+     * Returns the revision at the specified position.  Spilled revisions are
+     * read back into a fresh object every time, which the buffer does not
+     * keep, so holding on to the result is up to the caller.  Throws
+     * std::system_error if the temporary file cannot be read or the record
+     * read back does not decode.
+     */
+    MediaWikiRevision_s operator[](size_t i) const;
+};
+
+#endif /* __REVISIONBUFFER_HH */
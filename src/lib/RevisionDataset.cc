@@ -0,0 +1,317 @@
+#include "RevisionDataset.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+static std::string segment_path(const std::string &path, uint64_t segment) {
+    return path + "." + std::to_string(segment);
+}
+
+/*************************** RevisionDataset ***************************/
+RevisionDataset::RevisionDataset(const std::string &path, const std::vector<uint64_t> &segments) {
+    std::vector<std::string> paths;
+    if (std::filesystem::exists(path)) {
+        paths.push_back(path);
+    }
+    for (uint64_t segment : segments) {
+        paths.push_back(segment_path(path, segment));
+    }
+
+    for (const std::string &p : paths) {
+        RevisionStore_u store = open_revision_store(p.c_str());
+        if (!store) {
+            stores.clear();
+            return;
+        }
+
+        std::vector<uint64_t> order(store->page_count());
+        for (uint64_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        const RevisionStore *s = store.get();
+        std::stable_sort(order.begin(), order.end(), [s](uint64_t a, uint64_t b) {
+            return s->page(a).id < s->page(b).id;
+        });
+
+        stores.push_back(std::move(store));
+        page_order.push_back(std::move(order));
+        positions.push_back(0);
+    }
+}
+
+MediaWikiPageHistory RevisionDataset::merge(const std::vector<std::pair<size_t, uint64_t>> &sources) {
+    // The sources are ordered from the oldest store to the newest one
+    const std::pair<size_t, uint64_t> &newest = sources.back();
+    MediaWikiPageHistory result;
+    result.page = stores[newest.first]->get_page(newest.second);
+
+    // Revision ID -> (store, revision index) of the metadata and of the
+    // text.  Later stores override, except that a stub keeps the text
+    // stored before; empty or deleted text replaces it like anything else.
+    typedef std::pair<size_t, uint64_t> Location;
+    std::unordered_map<int64_t, std::pair<Location, Location>> revisions;
+    for (const std::pair<size_t, uint64_t> &source : sources) {
+        const RevisionStore &store = *stores[source.first];
+        const StoredPage &page = store.page(source.second);
+        for (uint64_t i = page.first_revision; i < page.first_revision + page.revision_count; i++) {
+            Location location(source.first, i);
+            auto inserted = revisions.emplace(store.revision(i).id, std::make_pair(location, location));
+            std::pair<Location, Location> &entry = inserted.first->second;
+            entry.first = location;
+            if (!(store.revision(i).flags & StoredTextStub)) {
+                entry.second = location;
+            }
+        }
+    }
+
+    std::vector<int64_t> ids;
+    ids.reserve(revisions.size());
+    for (const auto &entry : revisions) {
+        ids.push_back(entry.first);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    for (int64_t id : ids) {
+        const Location &meta = revisions[id].first;
+        const Location &text = revisions[id].second;
+        MediaWikiRevision_s rev = stores[meta.first]->get_revision(meta.second, result.page);
+        if (text != meta) {
+            rev->text = std::string(stores[text.first]->text(text.second).text);
+            rev->text_stub = false;
+        }
+        result.revisions.push_back(rev);
+    }
+    return result;
+}
+
+MediaWikiPageHistory RevisionDataset::read_page() {
+    // Find the smallest page ID any of the stores has yet to return
+    bool found = false;
+    int64_t id = 0;
+    for (size_t i = 0; i < stores.size(); i++) {
+        if (positions[i] < page_order[i].size()) {
+            int64_t candidate = stores[i]->page(page_order[i][positions[i]]).id;
+            if (!found || candidate < id) {
+                id = candidate;
+                found = true;
+            }
+        }
+    }
+
+    if (!found) {
+        return {nullptr, {}};
+    }
+
+    std::vector<std::pair<size_t, uint64_t>> sources;
+    for (size_t i = 0; i < stores.size(); i++) {
+        while (positions[i] < page_order[i].size() &&
+                stores[i]->page(page_order[i][positions[i]]).id == id) {
+            sources.push_back({i, page_order[i][positions[i]]});
+            positions[i]++;
+        }
+    }
+
+    return merge(sources);
+}
+
+MediaWikiPageHistory RevisionDataset::find_page(int64_t id) {
+    std::vector<std::pair<size_t, uint64_t>> sources;
+    for (size_t i = 0; i < stores.size(); i++) {
+        const RevisionStore *s = stores[i].get();
+        auto it = std::lower_bound(page_order[i].begin(), page_order[i].end(), id,
+            [s](uint64_t page, int64_t id) { return s->page(page).id < id; });
+        for (; it != page_order[i].end() && s->page(*it).id == id; it++) {
+            sources.push_back({i, *it});
+        }
+    }
+
+    if (sources.empty()) {
+        return {nullptr, {}};
+    }
+    return merge(sources);
+}
+
+/*************************** Maintenance ***************************/
+std::vector<uint64_t> list_dataset_segments(const std::string &path) {
+    std::filesystem::path base(path);
+    std::filesystem::path dir = base.has_parent_path() ? base.parent_path() : ".";
+    std::string prefix = base.filename().string() + ".";
+
+    std::vector<uint64_t> segments;
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) != 0 || name.size() == prefix.size()) {
+            continue;
+        }
+
+        std::string suffix = name.substr(prefix.size());
+        if (std::all_of(suffix.begin(), suffix.end(), ::isdigit)) {
+            segments.push_back(std::stoull(suffix));
+        }
+    }
+
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+std::unique_ptr<RevisionDataset> open_revision_dataset(const std::string &path) {
+    std::unique_ptr<RevisionDataset> dataset(new RevisionDataset(path, list_dataset_segments(path)));
+    if (!dataset->valid()) {
+        return nullptr;
+    }
+    return dataset;
+}
+
+/**
+ * Takes the next segment number from the counter file next to the dataset.
+ * The counter only ever grows, so a segment is numbered after everything
+ * appended or compacted before, even once compaction has removed the
+ * segments with the highest numbers.  Returns 0 on error.
+ */
+static uint64_t next_segment_number(const std::string &path) {
+    int fd = open((path + ".seq").c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    char buffer[32] = {0};
+    ssize_t len = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    uint64_t last = len > 0 ? strtoull(buffer, nullptr, 10) : 0;
+
+    // Datasets from before the counter existed only have their segments
+    std::vector<uint64_t> segments = list_dataset_segments(path);
+    if (!segments.empty()) {
+        last = std::max(last, segments.back());
+    }
+
+    uint64_t next = last + 1;
+    std::string number = std::to_string(next) + "\n";
+    bool ok = ftruncate(fd, 0) == 0 &&
+              pwrite(fd, number.data(), number.size(), 0) == static_cast<ssize_t>(number.size());
+
+    close(fd);
+    return ok ? next : 0;
+}
+
+bool append_to_dataset(const std::string &path, const char *dump_path) {
+    std::unique_ptr<XMLDumpParser> parser;
+    try {
+        parser.reset(new XMLDumpParser(dump_path, Streaming));
+    } catch (const XMLDumpError &) {
+        return false;
+    }
+
+    uint64_t next = next_segment_number(path);
+    if (next == 0) {
+        return false;
+    }
+    std::string target = segment_path(path, next);
+    // Not a valid segment name, so nobody picks it up half-written
+    std::string temporary = target + ".tmp";
+
+    RevisionStoreWriter writer(temporary.c_str());
+    if (!writer.valid()) {
+        return false;
+    }
+
+    try {
+        for (MediaWikiPage_s page = parser->next_page(); page; page = parser->next_page()) {
+            writer.begin_page(*page);
+            while (MediaWikiRevision_s rev = parser->next_revision()) {
+                writer.add_revision(*rev);
+            }
+        }
+    } catch (...) {
+        remove(temporary.c_str());
+        throw;
+    }
+
+    // Unlike rename(), link() never replaces an existing segment
+    bool ok = writer.finish() && link(temporary.c_str(), target.c_str()) == 0;
+    remove(temporary.c_str());
+    return ok;
+}
+
+// Does the work of compact_dataset() while holding the lock
+static bool compact_locked(const std::string &path) {
+    std::vector<uint64_t> segments = list_dataset_segments(path);
+    if (segments.empty()) {
+        return true;
+    }
+
+    std::string temporary = path + ".compact";
+    try {
+        RevisionDataset dataset(path, segments);
+        if (!dataset.valid()) {
+            return false;
+        }
+
+        RevisionStoreWriter writer(temporary.c_str());
+        if (!writer.valid()) {
+            return false;
+        }
+
+        for (MediaWikiPageHistory ph = dataset.read_page(); ph.page; ph = dataset.read_page()) {
+            writer.add_page(ph);
+        }
+
+        if (!writer.finish()) {
+            remove(temporary.c_str());
+            return false;
+        }
+    } catch (...) {
+        remove(temporary.c_str());
+        throw;
+    }
+
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+
+    // Should we stop before all of these are gone, the next compaction merges
+    // them again, which changes nothing, since the newest copy wins anyways
+    for (uint64_t segment : segments) {
+        remove(segment_path(path, segment).c_str());
+    }
+    return true;
+}
+
+bool compact_dataset(const std::string &path) {
+    // Held until the new base is in place, so that compactions of the same
+    // dataset take turns instead of writing over each other's temporary file
+    int lock = open((path + ".lock").c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock < 0) {
+        return false;
+    }
+    if (flock(lock, LOCK_EX) != 0) {
+        close(lock);
+        return false;
+    }
+
+    bool ok;
+    try {
+        ok = compact_locked(path);
+    } catch (...) {
+        close(lock);
+        throw;
+    }
+    close(lock);
+    return ok;
+}
+
+std::future<bool> compact_dataset_async(const std::string &path) {
+    return std::async(std::launch::async, compact_dataset, path);
+}
@@ -0,0 +1,88 @@
+#ifndef __REVISIONDATASET_HH
+#define __REVISIONDATASET_HH
+
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "RevisionStore.hh"
+
+/**
+ * A revision dataset is a base revision store at some path, plus a log of
+ * segments named path.1, path.2, etc., numbered from the counter in path.seq.
+ * Each segment is a revision store holding one incremental (adds-changes)
+ * dump, so appending costs only as much as parsing the increment.
+ * Compaction folds the segments back into the base.
+ *
+ * The contents of the dataset are the union of all stores: a page takes its
+ * title and namespace from the newest store that has it, and when the same
+ * revision appears more than once, the newest copy wins.  The one exception
+ * is the text of a stub, which keeps the text of an older copy; text that a
+ * newer dump has emptied or deleted replaces the older text.
+ */
+class RevisionDataset {
+  private:
+    std::vector<RevisionStore_u> stores;
+    // Page indices of each store, sorted by page ID
+    std::vector<std::vector<uint64_t>> page_order;
+    std::vector<uint64_t> positions;
+
+    MediaWikiPageHistory merge(const std::vector<std::pair<size_t, uint64_t>> &sources);
+
+  public:
+    /**
+     * Opens the base store and the specified segments.  A missing base is
+     * treated as empty.
+     */
+    RevisionDataset(const std::string &path, const std::vector<uint64_t> &segments);
+    RevisionDataset(RevisionDataset const&) = delete;
+
+    inline bool valid() const { return !stores.empty(); }
+
+    /**
+     * Reads the next page of the merged dataset, in the order of page IDs.
+     */
+    MediaWikiPageHistory read_page();
+
+    /**
+     * Returns the merged page with the specified ID, or a history with null
+     * page if there is none.
+     */
+    MediaWikiPageHistory find_page(int64_t id);
+};
+
+/**
+ * Lists the sequence numbers of the segments of the dataset in ascending
+ * order.
+ */
+std::vector<uint64_t> list_dataset_segments(const std::string &path);
+
+/**
+ * Opens the dataset with all its current segments.
+ */
+std::unique_ptr<RevisionDataset> open_revision_dataset(const std::string &path);
+
+/**
+ * Packs the dump into a new segment of the dataset.  The segment only becomes
+ * visible once it is complete.  Appends may run concurrently with each other
+ * and with compaction; each one takes its own segment number when it starts.
+ * Returns false if the dump cannot be opened or the segment written.
+ */
+bool append_to_dataset(const std::string &path, const char *dump_path);
+
+/**
+ * Merges the base and the segments that exist at the time of the call into a
+ * new base, then removes those segments.  Segments appended in the meantime
+ * are left alone, and readers which have the old files open keep working.
+ * Concurrent compactions of the same dataset wait for each other through a
+ * lock on path.lock.
+ */
+bool compact_dataset(const std::string &path);
+
+/**
+ * Runs compact_dataset() on a separate thread.
+ */
+std::future<bool> compact_dataset_async(const std::string &path);
+
+#endif /* __REVISIONDATASET_HH */
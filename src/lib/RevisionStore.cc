@@ -0,0 +1,495 @@
+#include "RevisionStore.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "ThreadPool.hh"
+
+static const char store_magic[8] = {'M', 'W', 'R', 'E', 'V', 'S', '0', '2'};
+
+#define MAX_INTERNED_STRINGS (1 << 20)
+
+/*************************** Timestamps ***************************/
+// Civil calendar conversions from Howard Hinnant's date algorithms
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+static void civil_from_days(int64_t z, int64_t &y, unsigned &m, unsigned &d) {
+    z += 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const unsigned doe = static_cast<unsigned>(z - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = static_cast<int64_t>(yoe) + era * 400 + (m <= 2);
+}
+
+int64_t parse_dump_timestamp(const std::string &timestamp) {
+    int y, m, d, hh, mm, ss;
+    if (sscanf(timestamp.c_str(), "%d-%d-%dT%d:%d:%d", &y, &m, &d, &hh, &mm, &ss) != 6) {
+        return 0;
+    }
+    return days_from_civil(y, m, d) * 86400 + hh * 3600 + mm * 60 + ss;
+}
+
+std::string format_dump_timestamp(int64_t timestamp) {
+    int64_t days = timestamp / 86400;
+    int64_t secs = timestamp % 86400;
+    if (secs < 0) {
+        secs += 86400;
+        days -= 1;
+    }
+
+    int64_t y;
+    unsigned m, d;
+    civil_from_days(days, y, m, d);
+
+    char result[32];
+    snprintf(result, sizeof(result), "%04lld-%02u-%02uT%02d:%02d:%02dZ",
+             static_cast<long long>(y), m, d, static_cast<int>(secs / 3600),
+             static_cast<int>(secs / 60 % 60), static_cast<int>(secs % 60));
+    return result;
+}
+
+/*************************** RevisionStoreWriter ***************************/
+RevisionStoreWriter::RevisionStoreWriter(const char *path, size_t _text_block_size)
+        : out(path, std::ofstream::binary | std::ofstream::trunc) {
+    text_block_size = _text_block_size;
+    pages_file = tmpfile();
+    revisions_file = tmpfile();
+    string_offsets_file = tmpfile();
+    string_data_file = tmpfile();
+
+    // The header is rewritten once we know where everything is
+    RevisionStoreHeader header;
+    memset(&header, 0, sizeof(header));
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    uint64_t first_offset = 0;
+    if (string_offsets_file) {
+        fwrite(&first_offset, sizeof(first_offset), 1, string_offsets_file);
+    }
+}
+
+RevisionStoreWriter::~RevisionStoreWriter() {
+    for (FILE *file : {pages_file, revisions_file, string_offsets_file, string_data_file}) {
+        if (file) {
+            fclose(file);
+        }
+    }
+}
+
+uint32_t RevisionStoreWriter::intern(const std::string &str) {
+    auto it = string_ids.find(str);
+    if (it != string_ids.end()) {
+        return it->second;
+    }
+
+    if (string_ids.size() >= MAX_INTERNED_STRINGS) {
+        string_ids.clear();
+    }
+
+    // The ids are 32 bits wide in the file
+    if (string_count >= UINT32_MAX) {
+        failed = true;
+        return 0;
+    }
+    uint32_t id = string_count++;
+    string_ids.emplace(str, id);
+    string_size += str.size();
+    fwrite(str.data(), 1, str.size(), string_data_file);
+    fwrite(&string_size, sizeof(string_size), 1, string_offsets_file);
+    return id;
+}
+
+void RevisionStoreWriter::flush_block() {
+    if (block.empty()) {
+        return;
+    }
+
+    uLongf compressed_size = compressBound(block.size());
+    std::vector<Bytef> compressed(compressed_size);
+    int ret = compress2(compressed.data(), &compressed_size,
+                        reinterpret_cast<const Bytef *>(block.data()), block.size(),
+                        Z_DEFAULT_COMPRESSION);
+    if (ret != Z_OK) {
+        failed = true;
+        block.clear();
+        return;
+    }
+
+    uint64_t offset = out.tellp();
+    out.write(reinterpret_cast<const char *>(compressed.data()), compressed_size);
+    blocks.push_back({offset, compressed_size, text_offset - block.size(), block.size()});
+    block.clear();
+}
+
+void RevisionStoreWriter::flush_page() {
+    if (in_page) {
+        fwrite(&page, sizeof(page), 1, pages_file);
+        in_page = false;
+    }
+}
+
+void RevisionStoreWriter::add_page(const MediaWikiPageHistory &history) {
+    begin_page(*history.page);
+    for (const MediaWikiRevision_s &rev : history.revisions) {
+        add_revision(*rev);
+    }
+}
+
+void RevisionStoreWriter::begin_page(const MediaWikiPage &_page) {
+    flush_page();
+
+    page.id = _page.get_id();
+    page.title = intern(_page.get_title());
+    page.ns = _page.get_namespace();
+    page.first_revision = revision_count;
+    page.revision_count = 0;
+    in_page = true;
+    page_count++;
+}
+
+void RevisionStoreWriter::add_revision(const MediaWikiRevision &rev) {
+    assert(in_page);
+
+    if (block.size() >= text_block_size) {
+        flush_block();
+    }
+
+    StoredRevision stored;
+    stored.id = rev.get_id();
+    stored.timestamp = parse_dump_timestamp(rev.get_timestamp());
+    stored.author_id = rev.get_author_id();
+    stored.author = intern(stored.author_id >= 0 ? rev.get_author_name()
+                                                 : rev.get_author_ip());
+    stored.comment = intern(rev.get_comment());
+    stored.page = page_count - 1;
+    stored.text_offset = text_offset;
+    stored.text_length = rev.get_text_size();
+    stored.flags = rev.is_text_stub() ? StoredTextStub : 0;
+    fwrite(&stored, sizeof(stored), 1, revisions_file);
+    revision_count++;
+    page.revision_count++;
+
+    block.append(rev.get_text_ptr(), rev.get_text_size());
+    text_offset += rev.get_text_size();
+}
+
+bool RevisionStoreWriter::append_file(FILE *file) {
+    if (fflush(file) != 0 || fseek(file, 0, SEEK_SET) != 0) {
+        return false;
+    }
+
+    std::vector<char> buffer(1024 * 1024);
+    size_t read;
+    while ((read = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+        out.write(buffer.data(), read);
+    }
+    return !ferror(file);
+}
+
+bool RevisionStoreWriter::finish() {
+    if (!valid()) {
+        return false;
+    }
+
+    flush_block();
+    flush_page();
+
+    RevisionStoreHeader header;
+    memcpy(header.magic, store_magic, sizeof(store_magic));
+    header.page_count = page_count;
+    header.revision_count = revision_count;
+    header.string_count = string_count;
+    header.block_count = blocks.size();
+
+    // Keep the tables aligned after the variable-length text blocks
+    static const char padding[8] = {0};
+    out.write(padding, (8 - out.tellp() % 8) % 8);
+
+    bool ok = !failed;
+    header.pages_offset = out.tellp();
+    ok = append_file(pages_file) && ok;
+    header.revisions_offset = out.tellp();
+    ok = append_file(revisions_file) && ok;
+    header.blocks_offset = out.tellp();
+    out.write(reinterpret_cast<const char *>(blocks.data()),
+              blocks.size() * sizeof(StoredTextBlock));
+    header.strings_offset = out.tellp();
+    ok = append_file(string_offsets_file) && ok;
+    ok = append_file(string_data_file) && ok;
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.flush();
+
+    return ok && static_cast<bool>(out);
+}
+
+/*************************** RevisionStore ***************************/
+RevisionStore::RevisionStore(void *_map, size_t _map_size) {
+    map = _map;
+    map_size = _map_size;
+
+    base = static_cast<const char *>(map);
+    header = reinterpret_cast<const RevisionStoreHeader *>(base);
+    pages = reinterpret_cast<const StoredPage *>(base + header->pages_offset);
+    revisions = reinterpret_cast<const StoredRevision *>(base + header->revisions_offset);
+    blocks = reinterpret_cast<const StoredTextBlock *>(base + header->blocks_offset);
+    string_offsets = reinterpret_cast<const uint64_t *>(base + header->strings_offset);
+    string_data = reinterpret_cast<const char *>(string_offsets + header->string_count + 1);
+}
+
+RevisionStore::~RevisionStore() {
+    munmap(map, map_size);
+}
+
+uint64_t RevisionStore::block_for(uint64_t revision) const {
+    uint64_t offset = revisions[revision].text_offset;
+    const StoredTextBlock *end = blocks + header->block_count;
+    const StoredTextBlock *it = std::upper_bound(blocks, end, offset,
+        [](uint64_t offset, const StoredTextBlock &b) { return offset < b.text_offset; });
+
+    if (it == blocks) {
+        throw RevisionStoreError("revision " + std::to_string(revision) + " has no text block");
+    }
+    return it - blocks - 1;
+}
+
+std::shared_ptr<const std::string> RevisionStore::block(uint64_t i) {
+    {
+        std::unique_lock<std::mutex> guard(cache_lock);
+        auto it = block_cache.find(i);
+        if (it != block_cache.end()) {
+            if (std::shared_ptr<const std::string> cached = it->second.lock()) {
+                return cached;
+            }
+        }
+    }
+
+    // Decompress outside of the lock, so that the blocks can be decompressed
+    // in parallel; two threads racing for the same block merely waste time.
+    const StoredTextBlock &b = blocks[i];
+    std::shared_ptr<std::string> result = std::make_shared<std::string>(b.text_length, '\0');
+    uLongf length = b.text_length;
+    int ret = uncompress(reinterpret_cast<Bytef *>(&(*result)[0]), &length,
+                         reinterpret_cast<const Bytef *>(base + b.offset), b.compressed_size);
+    if (ret != Z_OK || length != b.text_length) {
+        throw RevisionStoreError("text block " + std::to_string(i) + " is corrupt");
+    }
+
+    std::unique_lock<std::mutex> guard(cache_lock);
+    // Forget the blocks nobody holds anymore once in a while
+    if (block_cache.size() > 1024) {
+        for (auto it = block_cache.begin(); it != block_cache.end();) {
+            it = it->second.expired() ? block_cache.erase(it) : std::next(it);
+        }
+    }
+    block_cache[i] = result;
+    return result;
+}
+
+StoredText RevisionStore::text(uint64_t revision) {
+    const StoredRevision &rev = revisions[revision];
+    if (rev.text_length == 0) {
+        return {nullptr, std::string_view()};
+    }
+
+    uint64_t i = block_for(revision);
+    std::shared_ptr<const std::string> b = block(i);
+    return {b, block_text(*b, i, rev)};
+}
+
+void RevisionStore::for_each_text(uint64_t first, uint64_t last, unsigned threads,
+                                  std::function<void(uint64_t, std::string_view)> fn) {
+    if (first >= last) {
+        return;
+    }
+
+    ThreadPool pool(threads);
+
+    // Hand out runs of revisions sharing a block, so that every block is
+    // decompressed exactly once
+    uint64_t start = first;
+    while (start < last) {
+        uint64_t end = start + 1;
+        if (revisions[start].text_length > 0) {
+            const StoredTextBlock &b = blocks[block_for(start)];
+            while (end < last && (revisions[end].text_length == 0 ||
+                    revisions[end].text_offset < b.text_offset + b.text_length)) {
+                end++;
+            }
+        }
+
+        pool.submit([this, start, end, &fn] {
+            for (uint64_t i = start; i < end; i++) {
+                StoredText t = text(i);
+                fn(i, t.text);
+            }
+        });
+        start = end;
+    }
+
+    pool.wait();
+}
+
+std::string_view RevisionStore::block_text(const std::string &block, uint64_t i,
+                                           const StoredRevision &rev) const {
+    uint64_t start = rev.text_offset - blocks[i].text_offset;
+    if (rev.text_length > block.size() || start > block.size() - rev.text_length) {
+        throw RevisionStoreError("revision text reaches past text block " + std::to_string(i));
+    }
+    return std::string_view(block.data() + start, rev.text_length);
+}
+
+std::string_view RevisionStore::checked_string(uint64_t id) const {
+    if (id >= header->string_count) {
+        throw RevisionStoreError("string " + std::to_string(id) + " does not exist");
+    }
+    return string(id);
+}
+
+MediaWikiPage_s RevisionStore::get_page(uint64_t i) const {
+    MediaWikiPage_s page(new MediaWikiPage());
+    page->id = pages[i].id;
+    page->title = std::string(checked_string(pages[i].title));
+    page->ns = pages[i].ns;
+    page->offset = 0;
+    return page;
+}
+
+MediaWikiRevision_s RevisionStore::get_revision(uint64_t i, MediaWikiPage_s page) {
+    const StoredRevision &stored = revisions[i];
+
+    MediaWikiRevision_s rev(new MediaWikiRevision());
+    rev->id = stored.id;
+    rev->timestamp = format_dump_timestamp(stored.timestamp);
+    rev->author_id = stored.author_id;
+    if (stored.author_id >= 0) {
+        rev->author_name = std::string(checked_string(stored.author));
+    } else {
+        rev->author_ip = std::string(checked_string(stored.author));
+    }
+    rev->comment = std::string(checked_string(stored.comment));
+    rev->text_stub = stored.flags & StoredTextStub;
+    rev->page = page;
+
+    if (stored.text_length > 0) {
+        uint64_t b = block_for(i);
+        if (!current_block || current_block_index != b) {
+            current_block = block(b);
+            current_block_index = b;
+        }
+        rev->text = block_text(*current_block, b, stored);
+    }
+
+    return rev;
+}
+
+MediaWikiRevision_s RevisionStore::read_revision() {
+    if (next_revision >= header->revision_count) {
+        return nullptr;
+    }
+
+    // Hand out the same page object for all revisions of a page, so that
+    // the callers can tell where a page ends the way they do with the parser
+    uint64_t i = next_revision++;
+    if (!current_page || current_page_index != revisions[i].page) {
+        current_page = get_page(revisions[i].page);
+        current_page_index = revisions[i].page;
+    }
+    return get_revision(i, current_page);
+}
+
+MediaWikiPageHistory RevisionStore::read_page() {
+    if (next_page >= header->page_count) {
+        return {nullptr, {}};
+    }
+
+    const StoredPage &stored = pages[next_page];
+    MediaWikiPageHistory result;
+    result.page = get_page(next_page++);
+    for (uint64_t i = stored.first_revision; i < stored.first_revision + stored.revision_count; i++) {
+        result.revisions.push_back(get_revision(i, result.page));
+    }
+    return result;
+}
+
+// Checks that the text blocks and the strings lie within the file, so that
+// nothing read through the tables points outside of the mapping
+static bool valid_store(const char *base, uint64_t size) {
+    const RevisionStoreHeader *header = reinterpret_cast<const RevisionStoreHeader *>(base);
+    auto fits = [size](uint64_t offset, uint64_t count, uint64_t width) {
+        return offset <= size && count <= (size - offset) / width;
+    };
+    if (memcmp(header->magic, store_magic, sizeof(store_magic)) ||
+            !fits(header->pages_offset, header->page_count, sizeof(StoredPage)) ||
+            !fits(header->revisions_offset, header->revision_count, sizeof(StoredRevision)) ||
+            !fits(header->blocks_offset, header->block_count, sizeof(StoredTextBlock)) ||
+            header->string_count == UINT64_MAX ||
+            !fits(header->strings_offset, header->string_count + 1, sizeof(uint64_t))) {
+        return false;
+    }
+
+    const StoredTextBlock *blocks =
+        reinterpret_cast<const StoredTextBlock *>(base + header->blocks_offset);
+    for (uint64_t i = 0; i < header->block_count; i++) {
+        if (!fits(blocks[i].offset, blocks[i].compressed_size, 1) ||
+                (i > 0 && blocks[i].text_offset < blocks[i - 1].text_offset)) {
+            return false;
+        }
+    }
+
+    const uint64_t *string_offsets =
+        reinterpret_cast<const uint64_t *>(base + header->strings_offset);
+    uint64_t data_offset = header->strings_offset + (header->string_count + 1) * sizeof(uint64_t);
+    for (uint64_t i = 0; i < header->string_count; i++) {
+        if (string_offsets[i] > string_offsets[i + 1]) {
+            return false;
+        }
+    }
+    return string_offsets[0] == 0 && fits(data_offset, string_offsets[header->string_count], 1);
+}
+
+RevisionStore_u open_revision_store(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(RevisionStoreHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+
+    if (!valid_store(static_cast<const char *>(map), st.st_size)) {
+        munmap(map, st.st_size);
+        return nullptr;
+    }
+
+    return RevisionStore_u(new RevisionStore(map, st.st_size));
+}
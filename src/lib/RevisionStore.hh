@@ -0,0 +1,275 @@
+#ifndef __REVISIONSTORE_HH
+#define __REVISIONSTORE_HH
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "XMLDumpParser.hh"
+
+/**
+ * The revision store is a packed binary form of an XML dump which can be read
+ * without any parsing.  The file consists of:
+ *
+ *  - the header;
+ *  - revision text, concatenated and cut into blocks of roughly
+ *    text_block_size bytes which are compressed independently.  A revision
+ *    never spans two blocks;
+ *  - page records;
+ *  - fixed-width revision records, grouped by page;
+ *  - the text block table;
+ *  - the string table shared by titles, user names, IPs and comments, which
+ *    is an array of string_count + 1 offsets followed by the string data.
+ *
+ * Everything is stored in host byte order so that the file can be used
+ * directly through mmap().
+ */
+
+struct RevisionStoreHeader {
+    char magic[8];
+    uint64_t page_count;
+    uint64_t revision_count;
+    uint64_t string_count;
+    uint64_t block_count;
+
+    uint64_t pages_offset;
+    uint64_t revisions_offset;
+    uint64_t strings_offset;
+    uint64_t blocks_offset;
+};
+
+struct StoredPage {
+    int64_t id;
+    uint32_t title;
+    int32_t ns;
+    uint64_t first_revision;
+    uint64_t revision_count;
+};
+
+struct StoredRevision {
+    int64_t id;
+    // Seconds since the epoch
+    int64_t timestamp;
+    // -1 for anonymous edits, in which case author is the IP
+    int64_t author_id;
+    uint32_t author;
+    uint32_t comment;
+    uint64_t page;
+    // Offset of the text within the concatenation of all revision texts
+    uint64_t text_offset;
+    uint64_t text_length;
+    uint64_t flags;
+};
+
+enum StoredRevisionFlags {
+    // The dump left out the text, as the stub dumps do
+    StoredTextStub = 1
+};
+
+struct StoredTextBlock {
+    uint64_t offset;
+    uint64_t compressed_size;
+    uint64_t text_offset;
+    uint64_t text_length;
+};
+
+/**
+ * Converts the "2001-01-15T13:15:00Z" timestamps used in the dumps into
+ * seconds since the epoch and back.
+ */
+int64_t parse_dump_timestamp(const std::string &timestamp);
+std::string format_dump_timestamp(int64_t timestamp);
+
+/**
+ * Thrown by RevisionStore when a record refers to text or strings which the
+ * file does not contain, or a text block does not decompress.
+ */
+class RevisionStoreError : public std::runtime_error {
+  public:
+    RevisionStoreError(const std::string &what) : std::runtime_error(what) {}
+};
+
+/**
+ * Writes a revision store as the revisions come.  The text goes straight to
+ * the output, and the page, revision and string tables are spilled to
+ * temporary files until finish() appends them, so memory use stays bounded
+ * by the text block size, the block table (32 bytes per block) and the
+ * deduplication of at most a million strings at a time.  Strings
+ * seen again after that many others are stored again.
+ */
+class RevisionStoreWriter {
+  private:
+    std::ofstream out;
+    size_t text_block_size;
+
+    FILE *pages_file;
+    FILE *revisions_file;
+    FILE *string_offsets_file;
+    FILE *string_data_file;
+
+    // The page being added, written out when the next one begins
+    StoredPage page;
+    bool in_page = false;
+    uint64_t page_count = 0;
+    uint64_t revision_count = 0;
+    std::vector<StoredTextBlock> blocks;
+
+    std::unordered_map<std::string, uint32_t> string_ids;
+    uint64_t string_count = 0;
+    uint64_t string_size = 0;
+
+    std::string block;
+    uint64_t text_offset = 0;
+
+    // Set when a block cannot be compressed or the string ids run out
+    bool failed = false;
+
+    uint32_t intern(const std::string &str);
+    void flush_block();
+    void flush_page();
+    bool append_file(FILE *file);
+
+  public:
+    RevisionStoreWriter(const char *path, size_t text_block_size = 1024 * 1024);
+    RevisionStoreWriter(RevisionStoreWriter const&) = delete;
+    ~RevisionStoreWriter();
+
+    inline bool valid() const {
+        return out && pages_file && revisions_file && string_offsets_file && string_data_file;
+    }
+
+    /**
+     * Adds a page along with its revisions.  The revisions have to be in the
+     * order they should be read back in.
+     */
+    void add_page(const MediaWikiPageHistory &history);
+
+    /**
+     * Adds a page whose revisions are then passed one by one, so that the
+     * entire history never has to be in memory at once.
+     */
+    void begin_page(const MediaWikiPage &page);
+    void add_revision(const MediaWikiRevision &rev);
+
+    /**
+     * Writes out the tables and the header.  Returns false if any write
+     * has failed, or if the dump has more strings than the 32-bit string
+     * ids can number.
+     */
+    bool finish();
+};
+
+/**
+ * Text of a stored revision.  Holds a reference to the decompressed block,
+ * so that the view remains valid for as long as this object exists.
+ */
+struct StoredText {
+    std::shared_ptr<const std::string> block;
+    std::string_view text;
+};
+
+class RevisionStore {
+  private:
+    void *map;
+    size_t map_size;
+
+    const char *base;
+    const RevisionStoreHeader *header;
+    const StoredPage *pages;
+    const StoredRevision *revisions;
+    const uint64_t *string_offsets;
+    const char *string_data;
+    const StoredTextBlock *blocks;
+
+    // Blocks which are still referenced by someone
+    std::mutex cache_lock;
+    std::unordered_map<uint64_t, std::weak_ptr<const std::string>> block_cache;
+    // The block used by the sequential reads, kept alive between them
+    std::shared_ptr<const std::string> current_block;
+    uint64_t current_block_index = 0;
+
+    uint64_t next_page = 0;
+    uint64_t next_revision = 0;
+    // The page of the last revision read_revision() returned
+    MediaWikiPage_s current_page;
+    uint64_t current_page_index = 0;
+
+    std::string_view block_text(const std::string &block, uint64_t i,
+                                const StoredRevision &rev) const;
+    std::string_view checked_string(uint64_t id) const;
+
+  public:
+    /**
+     * Takes over a mapping open_revision_store() has validated.  The reads
+     * throw RevisionStoreError where the records turn out to be corrupt.
+     */
+    RevisionStore(void *map, size_t map_size);
+    RevisionStore(RevisionStore const&) = delete;
+    ~RevisionStore();
+
+    inline uint64_t page_count() const { return header->page_count; }
+    inline uint64_t revision_count() const { return header->revision_count; }
+    inline uint64_t block_count() const { return header->block_count; }
+
+    inline const StoredPage &page(uint64_t i) const { return pages[i]; }
+    inline const StoredRevision &revision(uint64_t i) const { return revisions[i]; }
+    inline const StoredTextBlock &text_block(uint64_t i) const { return blocks[i]; }
+
+    inline std::string_view string(uint32_t id) const {
+        return std::string_view(string_data + string_offsets[id],
+                                string_offsets[id + 1] - string_offsets[id]);
+    }
+
+    /**
+     * Returns the index of the block containing the text of the revision.
+     */
+    uint64_t block_for(uint64_t revision) const;
+
+    /**
+     * Returns the decompressed block, reusing it if it is already in memory.
+     * Safe to call from multiple threads.
+     */
+    std::shared_ptr<const std::string> block(uint64_t i);
+
+    StoredText text(uint64_t revision);
+
+    /**
+     * Calls the function for the text of every revision in [first, last),
+     * decompressing the blocks in parallel on the specified number of
+     * threads.  The calls happen concurrently and in no particular order.
+     */
+    void for_each_text(uint64_t first, uint64_t last, unsigned threads,
+                       std::function<void(uint64_t, std::string_view)> fn);
+
+    /**
+     * Build the objects XMLDumpParser would return for the specified page and
+     * revision records.  The revision has to belong to the page.
+     */
+    MediaWikiPage_s get_page(uint64_t i) const;
+    MediaWikiRevision_s get_revision(uint64_t i, MediaWikiPage_s page);
+
+    /**
+     * Sequential access mirroring XMLDumpParser.  Pages and revisions are
+     * read through independent cursors.
+     */
+    MediaWikiRevision_s read_revision();
+    MediaWikiPageHistory read_page();
+};
+
+typedef std::unique_ptr<RevisionStore> RevisionStore_u;
+
+/**
+ * Maps the store into memory.  Returns nullptr if the file cannot be opened
+ * or is not a revision store, including when its tables point outside of
+ * the file.
+ */
+RevisionStore_u open_revision_store(const char *path);
+
+#endif /* __REVISIONSTORE_HH */
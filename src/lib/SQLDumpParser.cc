@@ -1,6 +1,8 @@
 #include "SQLDumpParser.hh"
 
+#include <algorithm>
 #include <cctype>
+#include <cstring>
 
 /*************************** SQLData ***************************/
 SQLData::SQLData(std::string && str) {
@@ -36,6 +38,22 @@ SQLData::SQLData(const SQLData & data) {
     }
 }
 
+SQLData &SQLData::operator=(const SQLData &data) {
+    if (this != &data) {
+        if (type == String) {
+            delete value.str;
+        }
+
+        type = data.type;
+        if (type == String) {
+            value.str = new std::string(*data.value.str);
+        } else {
+            value = data.value;
+        }
+    }
+    return *this;
+}
+
 SQLData::~SQLData() {
     if (type == String) {
         delete value.str;
@@ -46,6 +64,47 @@ SQLData::~SQLData() {
 SQLDumpParser::SQLDumpParser(std::string &&path) {
     input = open_compressed_dump(path.c_str());
     assert(input);
+    buffer.reset(new char[input_buffer_size]);
+}
+
+SQLDumpParser::SQLDumpParser(std::string &&path, uint64_t begin, uint64_t end,
+                             const DumpInputOptions &options) {
+    assert(begin <= end);
+    input = open_compressed_dump(path.c_str(), {begin, begin}, options);
+    assert(input);
+    buffer.reset(new char[input_buffer_size]);
+    input_left = end - begin;
+}
+
+bool SQLDumpParser::refill(size_t needed) {
+    // Keep the unread characters, and top up the buffer after them
+    if (pos > 0) {
+        memmove(buffer.get(), buffer.get() + pos, len - pos);
+        len -= pos;
+        pos = 0;
+    }
+
+    while (len < needed && !input_eof) {
+        size_t wanted = std::min<uint64_t>(input_buffer_size - len, input_left);
+        ssize_t read = wanted > 0 ? input->read(buffer.get() + len, wanted) : 0;
+        if (read <= 0) {
+            input_eof = true;
+        } else {
+            len += read;
+            input_left -= read;
+        }
+    }
+
+    return len >= needed;
+}
+
+void SQLDumpParser::malformed(const char *what) {
+    // Where the row ends cannot be told any more, so give up on the rest
+    // of the statement and carry on from the next one
+    malformed_row = true;
+    mid_statement = false;
+    row_position = AfterRow;
+    throw SQLSchemaError(std::string("malformed row: ") + what);
 }
 
 bool SQLDumpParser::read_until_values() {
@@ -57,7 +116,7 @@ bool SQLDumpParser::read_until_values() {
     int pos = 0;
 
     while (target[pos] != 0) {
-        char cur = input->get();
+        int cur = next_char();
 
         if (cur == std::char_traits<char>::eof()) {
             return false;
@@ -75,103 +134,209 @@ bool SQLDumpParser::read_until_values() {
     return true;
 }
 
-SQLRow_u SQLDumpParser::get() {
-    SQLRow_u row{new SQLRow()};
-    const char eof = std::char_traits<char>::eof();
-
+bool SQLDumpParser::begin_row() {
     // Check if we need to skip to the next "VALUES" clause
     if (!mid_statement) {
         if (!read_until_values()) {
-            return nullptr;
+            return false;
         }
 
         mid_statement = true;
     }
 
     // Start tuple of values
-    assert(input->get() == '(');
+    malformed_row = false;
+    if (next_char() != '(') {
+        malformed("expected (");
+    }
+    row_position = BeforeField;
+    return true;
+}
+
+bool SQLDumpParser::next_field() {
+    // Check for the end of tuple
+    int cur = next_char();
+    if (cur != ',' && cur != ')') {
+        malformed("expected , or )");
+    }
+    row_position = cur == ',' ? BeforeField : AfterRow;
+    return cur == ',';
+}
+
+void SQLDumpParser::end_row() {
+    // Handle comma or semicolon at the end
+    int cur = next_char();
+    if (cur != ',' && cur != ';') {
+        malformed("expected , or ;");
+    }
+    if (cur == ';') {
+        mid_statement = false;
+    }
+}
+
+void SQLDumpParser::read_string(std::string &str) {
+    str.clear();
+    row_position = AfterField;
+    int cur = next_char();
+    if (cur != '\'') {
+        malformed("expected string");
+    }
+
+    // Copy the runs between the escapes straight from the buffer
     for (;;) {
-        char cur = input->get();
-
-        // String
-        if (cur == '\'') {
-            std::string str;
-            bool backslash = false;
-
-            // Read string while handling backslashes
-            for (;;) {
-                cur = input->get();
-                assert(cur != eof);
-
-                if (backslash) {
-                    str.push_back(cur);
-                    backslash = false;
-                } else {
-                    if (cur == '\\') {
-                        backslash = true;
-                    } else if (cur == '\'') {
-                        break;
-                    } else {
-                        str.push_back(cur);
-                    }
-                }
-            }
-
-            row->emplace_back(std::string(str.data(), str.size()));
-
-            // In other handers, this naturally points at ',' or ')'
-            cur = input->get();
+        if (pos == len && !refill(1)) {
+            malformed("dump ends within a string");
         }
 
-        // Integers/floats
-        if (isdigit(cur) || cur == '-') {
-            std::string str;
-            bool fpoint = false;
-
-            str.push_back(cur);
-            for (;;) {
-                cur = input->get();
-                assert(cur != eof);
-
-                if (cur == '.' && !fpoint) {
-                    fpoint = true;
-                    str.push_back(cur);
-                } else if (isdigit(cur)) {
-                    str.push_back(cur);
-                } else {
-                    break;
-                }
-            }
-
-            if (fpoint) {
-                row->emplace_back(std::stod(str));
-            } else {
-                row->emplace_back(static_cast<int64_t>(std::stoll(str)));
-            }
+        const char *start = buffer.get() + pos;
+        const char *end = buffer.get() + len;
+        const char *p = start;
+        while (p < end && *p != '\'' && *p != '\\') {
+            p++;
         }
+        str.append(start, p);
+        pos += p - start;
 
-        // Nulls
-        if (cur == 'N') {
-            assert(input->get() == 'U');
-            assert(input->get() == 'L');
-            assert(input->get() == 'L');
-            row->emplace_back();
-            cur = input->get();
+        if (p == end) {
+            continue;
         }
 
-        // Check for the end of tuple
-        assert(cur == ',' || cur == ')');
-        if (cur == ')') {
+        pos++;
+        if (*p == '\'') {
             break;
         }
+
+        // Backslash: the next character is taken as it is
+        cur = next_char();
+        if (cur == std::char_traits<char>::eof()) {
+            malformed("dump ends within a string");
+        }
+        str.push_back(cur);
     }
+}
 
-    // Handle comma or semicolon at the end
-    char cur = input->get();
-    assert(cur == ',' || cur == ';');
-    if (cur == ';') {
-        mid_statement = false;
+static inline bool is_number_char(int c) {
+    return isdigit(c) || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E';
+}
+
+std::string_view SQLDumpParser::read_number() {
+    row_position = AfterField;
+    if (len - pos < max_inline_number) {
+        refill(max_inline_number);
+    }
+
+    const char *start = buffer.get() + pos;
+    const char *end = buffer.get() + len;
+    const char *p = start;
+    while (p < end && is_number_char(*p)) {
+        p++;
+    }
+
+    if (p < end || input_eof) {
+        pos += p - start;
+        return std::string_view(start, p - start);
+    }
+
+    // Longer than the lookahead, so it has to be collected
+    scratch.assign(start, p);
+    pos = len;
+    while (is_number_char(peek())) {
+        scratch.push_back(next_char());
+    }
+    return scratch;
+}
+
+void SQLDumpParser::read_null() {
+    char null[4];
+    row_position = AfterField;
+    for (char &c : null) {
+        c = next_char();
+    }
+    if (memcmp(null, "NULL", 4) != 0) {
+        malformed("expected NULL");
+    }
+}
+
+SQLData SQLDumpParser::read_field() {
+    int cur = peek();
+
+    // String
+    if (cur == '\'') {
+        std::string str;
+        read_string(str);
+        return SQLData(std::move(str));
+    }
+
+    // Integers/floats
+    if (isdigit(cur) || cur == '-') {
+        std::string_view str = read_number();
+        const char *end = str.data() + str.size();
+
+        // Integers too large for 64 bits are kept as floats
+        int64_t integer;
+        if (parse_integer(str.data(), end, integer) == end) {
+            return SQLData(integer);
+        }
+
+        double fraction;
+        if (parse_double(str.data(), end, fraction) != end) {
+            malformed("invalid number");
+        }
+        return SQLData(fraction);
     }
 
+    // Nulls
+    read_null();
+    return SQLData();
+}
+
+std::string &SQLDumpParser::field_buffer(size_t column) {
+    if (column >= field_buffers.size()) {
+        field_buffers.resize(column + 1);
+    }
+    return field_buffers[column];
+}
+
+void SQLDumpParser::skip_field() {
+    switch (peek()) {
+        case '\'':
+            read_string(scratch);
+            break;
+        case 'N':
+            read_null();
+            break;
+        default:
+            read_number();
+            break;
+    }
+}
+
+void SQLDumpParser::recover_row() {
+    // Skip whatever is left of the row the typed decoding gave up on
+    if (row_position == AfterRow) {
+        end_row();
+        return;
+    }
+
+    if (row_position == BeforeField) {
+        skip_field();
+    }
+    while (next_field()) {
+        skip_field();
+    }
+    end_row();
+}
+
+SQLRow_u SQLDumpParser::get() {
+    if (!begin_row()) {
+        return nullptr;
+    }
+
+    SQLRow_u row{new SQLRow()};
+    do {
+        row->push_back(read_field());
+    } while (next_field());
+
+    end_row();
     return row;
 }
@@ -2,16 +2,24 @@
 #define __SQL_DUMP_PARSER_HH
 
 #include <cassert>
+#include <cctype>
 #include <cstdint>
 #include <cstring>
 #include <exception>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "CompressedDumpReader.hh"
+#include "NumericParsing.hh"
 
 typedef enum {
     String,
@@ -56,6 +64,8 @@ class SQLData {
     SQLData(const SQLData &data);
     SQLData();
 
+    SQLData &operator=(const SQLData &data);
+
     ~SQLData();
 };
 
@@ -81,15 +91,317 @@ namespace std {
     };
 }
 
+class SQLDumpParser;
+
+/**
+ * Thrown by the typed accessors of SQLDumpParser when a row does not match
+ * the requested types.  The offending row is skipped, so the parser can be
+ * used further.  Rows which are not valid SQL are reported the same way by
+ * get() as well, but then the rest of their INSERT statement is skipped.
+ */
+class SQLSchemaError : public std::runtime_error {
+  public:
+    SQLSchemaError(const std::string &what) : std::runtime_error(what) {}
+};
+
+/**
+ * Column type for the typed accessors which skips the column.
+ */
+struct SQLSkip {};
+
+/**
+ * Decodes a single field into a T.  Every specialization drives the lexer
+ * of SQLDumpParser directly for its kind of field, and throws SQLSchemaError
+ * without consuming anything if the field is of a different kind.
+ */
+template <typename T, typename Enable = void>
+struct SQLFieldDecoder;
+
 class SQLDumpParser {
+    public:
+        // Where the lexer is within the current row
+        enum RowPosition {
+            BeforeField,
+            AfterField,
+            AfterRow
+        };
+
     private:
+        static const size_t input_buffer_size = 1024 * 1024;
+        // A number shorter than this is always contiguous in the buffer
+        static const size_t max_inline_number = 64;
+
         CompressedDumpReader_u input;
+        std::unique_ptr<char[]> buffer;
+        size_t pos = 0;
+        size_t len = 0;
+        bool input_eof = false;
+        // Bytes the parser may still read from the input
+        uint64_t input_left = UINT64_MAX;
+
         bool mid_statement = false;
+        RowPosition row_position = AfterRow;
+        // Whether the current row turned out not to be valid SQL
+        bool malformed_row = false;
 
+        std::string scratch;
+        // Storage for the std::string_view fields of the current row
+        std::vector<std::string> field_buffers;
+
+        bool refill(size_t needed);
+        [[noreturn]] void malformed(const char *what);
         bool read_until_values();
+        bool next_field();
+        void end_row();
+        void skip_field();
+        void recover_row();
+
+        template <typename Tuple, size_t... Is>
+        void decode_row(Tuple &row, std::index_sequence<Is...>);
+
+        template <size_t I, size_t N, typename T>
+        void decode_field(T &out);
+
     public:
         SQLDumpParser(std::string && path);
+
+        /**
+         * Parses only the statements within the specified byte range of an
+         * uncompressed dump.  The range has to start at the beginning of an
+         * INSERT statement and end after the last statement it contains.
+         */
+        SQLDumpParser(std::string && path, uint64_t begin, uint64_t end,
+                      const DumpInputOptions &options = default_dump_input_options());
         SQLRow_u get();
+
+        /**
+         * Reads the next row straight into the tuple, decoding each column
+         * as the corresponding type, e.g.
+         *
+         *     std::tuple<int64_t, int32_t, std::string_view, std::optional<double>> row;
+         *     while (parser.get_as(row)) { ... }
+         *
+         * Supported are the integer and floating point types, std::string,
+         * std::string_view (valid until the next call), SQLData, SQLSkip and
+         * std::optional of those for the columns which may be NULL.  Returns
+         * false at the end of the dump, and throws SQLSchemaError if the row
+         * has another number of columns or a column of another type.
+         */
+        template <typename... Ts>
+        bool get_as(std::tuple<Ts...> &row);
+
+        template <typename... Ts>
+        std::optional<std::tuple<Ts...>> get_as();
+
+        /**
+         * Same as get_as(), but for a struct describing its columns as a
+         * tuple of member pointers, e.g.
+         *
+         *     struct Page {
+         *         int64_t id;
+         *         int32_t ns;
+         *         std::string title;
+         *         static constexpr auto sql_fields = std::make_tuple(
+         *             &Page::id, &Page::ns, &Page::title);
+         *     };
+         */
+        template <typename Row>
+        bool get_into(Row &row);
+
+        // Internal APIs used from SQLFieldDecoder
+        inline int peek() {
+            if (pos == len && !refill(1)) {
+                return std::char_traits<char>::eof();
+            }
+            return static_cast<unsigned char>(buffer[pos]);
+        }
+
+        inline int next_char() {
+            if (pos == len && !refill(1)) {
+                return std::char_traits<char>::eof();
+            }
+            return static_cast<unsigned char>(buffer[pos++]);
+        }
+
+        bool begin_row();
+        void read_string(std::string &str);
+        // The characters of the number, valid until the next call
+        std::string_view read_number();
+        void read_null();
+        SQLData read_field();
+        std::string &field_buffer(size_t column);
+};
+
+/*************************** Typed decoding ***************************/
+namespace sql_decoding {
+    inline const char *describe(int c) {
+        if (c == '\'') {
+            return "string";
+        }
+        if (c == 'N') {
+            return "NULL";
+        }
+        if (isdigit(c) || c == '-') {
+            return "number";
+        }
+        return "malformed field";
+    }
+
+    inline SQLSchemaError mismatch(size_t column, const char *expected, const char *found) {
+        return SQLSchemaError("column " + std::to_string(column) + ": expected " +
+                              expected + ", found " + found);
+    }
+}
+
+template <typename T>
+struct SQLFieldDecoder<T, typename std::enable_if<std::is_integral<T>::value &&
+                                                  !std::is_same<T, bool>::value>::type> {
+    static void decode(SQLDumpParser &parser, size_t column, T &out) {
+        int c = parser.peek();
+        if (!isdigit(c) && c != '-') {
+            throw sql_decoding::mismatch(column, "integer", sql_decoding::describe(c));
+        }
+
+        std::string_view str = parser.read_number();
+        const char *end = str.data() + str.size();
+        if (parse_integer(str.data(), end, out) != end) {
+            if (str.find_first_of(".eE") != std::string_view::npos) {
+                throw sql_decoding::mismatch(column, "integer", "fraction");
+            }
+            throw SQLSchemaError("column " + std::to_string(column) + ": " + std::string(str) +
+                                 " does not fit the integer type");
+        }
+    }
+};
+
+template <typename T>
+struct SQLFieldDecoder<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static void decode(SQLDumpParser &parser, size_t column, T &out) {
+        int c = parser.peek();
+        if (!isdigit(c) && c != '-') {
+            throw sql_decoding::mismatch(column, "number", sql_decoding::describe(c));
+        }
+
+        std::string_view str = parser.read_number();
+        const char *end = str.data() + str.size();
+        double value;
+        if (parse_double(str.data(), end, value) != end) {
+            throw SQLSchemaError("column " + std::to_string(column) + ": " + std::string(str) +
+                                 " is not a valid number");
+        }
+        out = static_cast<T>(value);
+    }
+};
+
+template <>
+struct SQLFieldDecoder<std::string> {
+    static void decode(SQLDumpParser &parser, size_t column, std::string &out) {
+        int c = parser.peek();
+        if (c != '\'') {
+            throw sql_decoding::mismatch(column, "string", sql_decoding::describe(c));
+        }
+        parser.read_string(out);
+    }
 };
 
+template <>
+struct SQLFieldDecoder<std::string_view> {
+    static void decode(SQLDumpParser &parser, size_t column, std::string_view &out) {
+        std::string &str = parser.field_buffer(column);
+        SQLFieldDecoder<std::string>::decode(parser, column, str);
+        out = str;
+    }
+};
+
+template <>
+struct SQLFieldDecoder<SQLData> {
+    static void decode(SQLDumpParser &parser, size_t, SQLData &out) {
+        out = parser.read_field();
+    }
+};
+
+template <>
+struct SQLFieldDecoder<SQLSkip> {
+    static void decode(SQLDumpParser &parser, size_t, SQLSkip &) {
+        parser.read_field();
+    }
+};
+
+template <typename T>
+struct SQLFieldDecoder<std::optional<T>> {
+    static void decode(SQLDumpParser &parser, size_t column, std::optional<T> &out) {
+        if (parser.peek() == 'N') {
+            parser.read_null();
+            out.reset();
+            return;
+        }
+
+        T value;
+        SQLFieldDecoder<T>::decode(parser, column, value);
+        out = std::move(value);
+    }
+};
+
+template <size_t I, size_t N, typename T>
+void SQLDumpParser::decode_field(T &out) {
+    if (I > 0 && !next_field()) {
+        throw SQLSchemaError("row has " + std::to_string(I) + " columns, expected " +
+                             std::to_string(N));
+    }
+
+    row_position = BeforeField;
+    SQLFieldDecoder<typename std::remove_reference<T>::type>::decode(*this, I, out);
+    row_position = AfterField;
+}
+
+template <typename Tuple, size_t... Is>
+void SQLDumpParser::decode_row(Tuple &row, std::index_sequence<Is...>) {
+    const size_t N = sizeof...(Is);
+
+    // Growing the buffers later would invalidate the views handed out so far
+    if (field_buffers.size() < N) {
+        field_buffers.resize(N);
+    }
+
+    try {
+        (decode_field<Is, N>(std::get<Is>(row)), ...);
+
+        if (next_field()) {
+            throw SQLSchemaError("row has more than " + std::to_string(N) + " columns");
+        }
+        end_row();
+    } catch (const SQLSchemaError &) {
+        if (!malformed_row) {
+            recover_row();
+        }
+        throw;
+    }
+}
+
+template <typename... Ts>
+bool SQLDumpParser::get_as(std::tuple<Ts...> &row) {
+    if (!begin_row()) {
+        return false;
+    }
+
+    decode_row(row, std::index_sequence_for<Ts...>());
+    return true;
+}
+
+template <typename... Ts>
+std::optional<std::tuple<Ts...>> SQLDumpParser::get_as() {
+    std::tuple<Ts...> row;
+    if (!get_as(row)) {
+        return std::nullopt;
+    }
+    return row;
+}
+
+template <typename Row>
+bool SQLDumpParser::get_into(Row &row) {
+    auto fields = std::apply([&row](auto... members) { return std::tie((row.*members)...); },
+                             Row::sql_fields);
+    return get_as(fields);
+}
+
 #endif /* __SQL_DUMP_PARSER_HH */
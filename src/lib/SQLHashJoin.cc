@@ -0,0 +1,200 @@
+#include "SQLHashJoin.hh"
+
+#include <algorithm>
+#include <cassert>
+
+#include "ThreadPool.hh"
+
+#define ARENA_BLOCK_SIZE (4 * 1024 * 1024)
+#define PROBE_BATCH_SIZE 4096
+
+// Rows of the build side are spread over the table with a multiplicative
+// hash; page IDs are dense, so the low bits alone would cluster badly.
+static inline uint64_t hash_key(int64_t key) {
+    uint64_t h = static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+}
+
+/*************************** SQLJoinTable ***************************/
+SQLJoinTable::SQLJoinTable(SQLDumpParser &build, size_t key_column, std::vector<size_t> columns)
+        : strings(ARENA_BLOCK_SIZE) {
+    bool all_columns = columns.empty();
+    column_count = columns.size();
+
+    while (SQLRow_u row = build.get()) {
+        if (key_column >= row->size() || !(*row)[key_column].is_int()) {
+            continue;
+        }
+
+        if (all_columns && keys.empty()) {
+            column_count = row->size();
+            for (size_t i = 0; i < row->size(); i++) {
+                columns.push_back(i);
+            }
+        }
+
+        keys.push_back(static_cast<int64_t>((*row)[key_column].as_int()));
+        for (size_t column : columns) {
+            Cell cell;
+            cell.integer = 0;
+            SQLDataType type = Null;
+
+            if (column < row->size()) {
+                const SQLData &value = (*row)[column];
+                if (value.is_int()) {
+                    type = Integer;
+                    cell.integer = static_cast<int64_t>(value.as_int());
+                } else if (value.is_float()) {
+                    type = Float;
+                    cell.fraction = value.as_float();
+                } else if (value.is_string()) {
+                    type = String;
+                    cell.str = intern(value.as_string());
+                }
+            }
+
+            cells.push_back(cell);
+            types.push_back(type);
+        }
+    }
+
+    // The strings are all in the arena now; the index is only for the build
+    strings.release_index();
+    keys.shrink_to_fit();
+    cells.shrink_to_fit();
+    types.shrink_to_fit();
+
+    build_index();
+}
+
+const char *SQLJoinTable::intern(const std::string &str) {
+    return strings.insert(hash_string(str), str).key;
+}
+
+void SQLJoinTable::build_index() {
+    assert(keys.size() < npos);
+
+    uint64_t capacity = 16;
+    while (capacity * 4 < keys.size() * 5) {
+        capacity *= 2;
+    }
+    slots.assign(capacity, npos);
+    slot_mask = capacity - 1;
+    next_rows.assign(keys.size(), npos);
+
+    // Insert in reverse, so that the chains come out in the dump order
+    for (uint32_t row = keys.size(); row-- > 0;) {
+        for (uint64_t i = hash_key(keys[row]) & slot_mask;; i = (i + 1) & slot_mask) {
+            if (slots[i] == npos) {
+                slots[i] = row;
+                break;
+            }
+            if (keys[slots[i]] == keys[row]) {
+                next_rows[row] = slots[i];
+                slots[i] = row;
+                break;
+            }
+        }
+    }
+}
+
+size_t SQLJoinTable::memory_usage() const {
+    return keys.capacity() * sizeof(int64_t) + cells.capacity() * sizeof(Cell) +
+           types.capacity() + next_rows.capacity() * sizeof(uint32_t) +
+           slots.capacity() * sizeof(uint32_t) + strings.memory_usage();
+}
+
+uint32_t SQLJoinTable::find(int64_t key) const {
+    for (uint64_t i = hash_key(key) & slot_mask;; i = (i + 1) & slot_mask) {
+        uint32_t row = slots[i];
+        if (row == npos || keys[row] == key) {
+            return row;
+        }
+    }
+}
+
+void SQLJoinTable::append_row(uint32_t row, SQLRow &out) const {
+    for (size_t i = row * column_count; i < (row + 1) * column_count; i++) {
+        switch (types[i]) {
+            case Integer:
+                out.emplace_back(cells[i].integer);
+                break;
+            case Float:
+                out.emplace_back(cells[i].fraction);
+                break;
+            case String:
+                out.emplace_back(std::string(StringTable::stored_string(cells[i].str)));
+                break;
+            default:
+                out.emplace_back();
+                break;
+        }
+    }
+}
+
+void SQLJoinTable::append_nulls(SQLRow &out) const {
+    for (size_t i = 0; i < column_count; i++) {
+        out.emplace_back();
+    }
+}
+
+/*************************** sql_hash_join ***************************/
+struct ProbeBatch {
+    std::vector<SQLRow_u> input;
+    std::vector<SQLRow> output;
+};
+
+void sql_hash_join(const SQLJoinTable &table, SQLDumpParser &probe, size_t key_column,
+                   unsigned threads, bool outer, std::function<void(const SQLRow &)> fn) {
+    ThreadPool pool(threads);
+    OrderedTasks<ProbeBatch> batches(pool);
+
+    auto deliver = [&batches, &fn] {
+        for (const SQLRow &row : batches.front().output) {
+            fn(row);
+        }
+        batches.pop();
+    };
+
+    bool finished = false;
+    while (!finished) {
+        std::shared_ptr<ProbeBatch> batch = std::make_shared<ProbeBatch>();
+        batch->input.reserve(PROBE_BATCH_SIZE);
+        while (batch->input.size() < PROBE_BATCH_SIZE) {
+            SQLRow_u row = probe.get();
+            if (!row) {
+                finished = true;
+                break;
+            }
+            batch->input.push_back(std::move(row));
+        }
+
+        batches.submit(batch, [&table, key_column, outer](ProbeBatch &batch) {
+            for (const SQLRow_u &row : batch.input) {
+                bool matched = false;
+                if (key_column < row->size() && (*row)[key_column].is_int()) {
+                    int64_t key = static_cast<int64_t>((*row)[key_column].as_int());
+                    for (uint32_t i = table.find(key); i != SQLJoinTable::npos; i = table.next(i)) {
+                        batch.output.push_back(*row);
+                        table.append_row(i, batch.output.back());
+                        matched = true;
+                    }
+                }
+
+                if (outer && !matched) {
+                    batch.output.push_back(*row);
+                    table.append_nulls(batch.output.back());
+                }
+            }
+            batch.input.clear();
+        });
+
+        while (batches.full()) {
+            deliver();
+        }
+    }
+
+    while (!batches.empty()) {
+        deliver();
+    }
+}
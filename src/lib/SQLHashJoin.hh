@@ -0,0 +1,96 @@
+#ifndef __SQL_HASH_JOIN_HH
+#define __SQL_HASH_JOIN_HH
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "SQLDumpParser.hh"
+#include "StringTable.hh"
+
+/**
+ * The build side of a hash join: the rows of one dump held in memory and
+ * looked up by an integer column.
+ *
+ * The rows are stored column-wise as 8-byte cells with a separate array of
+ * type tags.  Strings live in a StringTable, so equal strings are stored
+ * once, which matters for the columns like category names.  The hash table itself
+ * is an open-addressing array of row numbers sized exactly once after all
+ * rows are loaded, and rows with the same key are chained through a separate
+ * array.  This puts the memory use at about
+ *
+ *     rows * (12 + 9 * columns) + 4 * 2^ceil(log2(rows / 0.8)) + strings
+ *
+ * bytes, plus a temporary 48 to 96 bytes per distinct string during the build.
+ */
+class SQLJoinTable {
+  public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+  private:
+    union Cell {
+        int64_t integer;
+        double fraction;
+        // Points at a uint32_t length followed by the string
+        const char *str;
+    };
+
+    size_t column_count;
+    std::vector<int64_t> keys;
+    std::vector<Cell> cells;
+    std::vector<uint8_t> types;
+    std::vector<uint32_t> next_rows;
+
+    std::vector<uint32_t> slots;
+    uint64_t slot_mask = 0;
+
+    StringTable strings;
+
+    const char *intern(const std::string &str);
+    void build_index();
+
+  public:
+    /**
+     * Reads the entire dump.  Rows whose key column is not an integer are
+     * skipped.  The payload consists of the specified columns, or of all
+     * columns if none are specified.
+     */
+    SQLJoinTable(SQLDumpParser &build, size_t key_column, std::vector<size_t> columns = {});
+    SQLJoinTable(SQLJoinTable const&) = delete;
+
+    inline size_t size() const { return keys.size(); }
+    size_t memory_usage() const;
+
+    /**
+     * Returns the first row with the specified key, or npos.  The other rows
+     * with the same key follow through next().
+     */
+    uint32_t find(int64_t key) const;
+    inline uint32_t next(uint32_t row) const { return next_rows[row]; }
+
+    /**
+     * Appends the payload columns of the row to the SQL row.
+     */
+    void append_row(uint32_t row, SQLRow &out) const;
+
+    /**
+     * Appends as many NULLs as there are payload columns.
+     */
+    void append_nulls(SQLRow &out) const;
+};
+
+/**
+ * Streams the probe dump through the table, and calls the function for every
+ * joined row, which consists of the probe row followed by the payload of the
+ * matching build row.  The probe dump is parsed on the calling thread; only
+ * the lookups and the assembly of the joined rows are done in batches on the
+ * specified number of threads.  The function is always called from the
+ * calling thread, in the order of the probe dump.  In outer mode, probe rows without
+ * a match are passed with NULLs in place of the payload.
+ */
+void sql_hash_join(const SQLJoinTable &table, SQLDumpParser &probe, size_t key_column,
+                   unsigned threads, bool outer, std::function<void(const SQLRow &)> fn);
+
+#endif /* __SQL_HASH_JOIN_HH */
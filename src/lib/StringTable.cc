@@ -0,0 +1,88 @@
+#include "StringTable.hh"
+
+#include <algorithm>
+#include <cassert>
+
+StringTable::StringTable(size_t _block_size, size_t _initial_slots) {
+    block_size = _block_size;
+    initial_slots = _initial_slots;
+    slots.resize(initial_slots);
+}
+
+StringTable::Slot &StringTable::insert(uint64_t hash, std::string_view str) {
+    assert(!slots.empty());
+
+    uint64_t mask = slots.size() - 1;
+    uint64_t i = hash & mask;
+    for (;; i = (i + 1) & mask) {
+        Slot &slot = slots[i];
+        if (!slot.key) {
+            break;
+        }
+        if (slot.hash == hash && stored_string(slot.key) == str) {
+            return slot;
+        }
+    }
+
+    // Keep the load factor under one half
+    if ((count + 1) * 2 > slots.size()) {
+        grow();
+        mask = slots.size() - 1;
+        i = hash & mask;
+        while (slots[i].key) {
+            i = (i + 1) & mask;
+        }
+    }
+
+    // A new string, so copy it into the arena
+    size_t needed = sizeof(uint32_t) + str.size();
+    if (arena_used + needed > arena_capacity) {
+        arena_capacity = std::max(block_size, needed);
+        arena_blocks.emplace_back(new char[arena_capacity]);
+        arena_used = 0;
+        arena_size += arena_capacity;
+    }
+
+    char *stored = arena_blocks.back().get() + arena_used;
+    uint32_t len = str.size();
+    memcpy(stored, &len, sizeof(len));
+    memcpy(stored + sizeof(len), str.data(), str.size());
+    arena_used += needed;
+
+    count++;
+    slots[i] = {hash, stored, 0};
+    return slots[i];
+}
+
+void StringTable::grow() {
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    uint64_t mask = slots.size() - 1;
+
+    for (const Slot &slot : old) {
+        if (slot.key) {
+            uint64_t i = slot.hash & mask;
+            while (slots[i].key) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = slot;
+        }
+    }
+}
+
+size_t StringTable::memory_usage() const {
+    return slots.capacity() * sizeof(Slot) + arena_size;
+}
+
+void StringTable::release_index() {
+    std::vector<Slot>().swap(slots);
+}
+
+void StringTable::clear() {
+    std::vector<Slot>(initial_slots).swap(slots);
+    count = 0;
+    arena_blocks.clear();
+    arena_used = 0;
+    arena_capacity = 0;
+    arena_size = 0;
+}
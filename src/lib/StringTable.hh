@@ -0,0 +1,106 @@
+#ifndef __STRINGTABLE_HH
+#define __STRINGTABLE_HH
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/**
+ * Fast non-cryptographic hash for the keys of in-memory tables.  Not stable
+ * across versions, so nothing stored on disk may depend on it.
+ */
+inline uint64_t hash_string(std::string_view key) {
+    const uint64_t multiplier = 0xff51afd7ed558ccdULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ key.size();
+
+    const char *p = key.data();
+    size_t left = key.size();
+    for (; left >= 8; p += 8, left -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        h = (h ^ word) * multiplier;
+        h ^= h >> 32;
+    }
+    if (left > 0) {
+        uint64_t word = 0;
+        memcpy(&word, p, left);
+        h = (h ^ word) * multiplier;
+        h ^= h >> 32;
+    }
+
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * A set of distinct strings with a 64-bit value each.  The strings are
+ * copied into an arena of large blocks as a uint32_t length followed by the
+ * bytes, and found through an open-addressing table of their hashes kept
+ * under one half full.  The stored strings never move, so pointers to them
+ * stay valid until clear().
+ */
+class StringTable {
+  public:
+    struct Slot {
+        uint64_t hash;
+        // Points at the stored string, or null if the slot is empty
+        const char *key;
+        uint64_t value;
+    };
+
+  private:
+    size_t block_size;
+    size_t initial_slots;
+
+    std::vector<Slot> slots;
+    size_t count = 0;
+
+    std::vector<std::unique_ptr<char[]>> arena_blocks;
+    size_t arena_used = 0;
+    size_t arena_capacity = 0;
+    size_t arena_size = 0;
+
+    void grow();
+
+  public:
+    StringTable(size_t block_size, size_t initial_slots = 1024);
+    StringTable(StringTable const&) = delete;
+
+    static inline std::string_view stored_string(const char *key) {
+        uint32_t len;
+        memcpy(&len, key, sizeof(len));
+        return std::string_view(key + sizeof(len), len);
+    }
+
+    inline size_t size() const { return count; }
+    inline const std::vector<Slot> &table() const { return slots; }
+
+    /**
+     * Returns the slot of the string, adding it with a zero value if it is
+     * not there yet.  The hash has to be the one hash_string() gives.  The
+     * reference is valid until the next insert().
+     */
+    Slot &insert(uint64_t hash, std::string_view str);
+
+    /**
+     * Bytes used by the table and the arena.
+     */
+    size_t memory_usage() const;
+
+    /**
+     * Frees the table but keeps the strings, for when nothing is going to be
+     * looked up or added anymore.
+     */
+    void release_index();
+
+    /**
+     * Forgets all strings and frees their memory.
+     */
+    void clear();
+};
+
+#endif /* __STRINGTABLE_HH */
@@ -0,0 +1,204 @@
+#include "TextTokenizer.hh"
+
+#include <cstdint>
+
+enum CodePointClass {
+    Separator,
+    Letter,
+    // A word on its own
+    Ideograph
+};
+
+static CodePointClass classify(uint32_t cp) {
+    if (cp < 0x100) {
+        // Latin-1 punctuation and symbols, but for ª, µ, º, × and ÷
+        if (cp < 0xc0) {
+            return cp == 0xaa || cp == 0xb5 || cp == 0xba ? Letter : Separator;
+        }
+        return cp == 0xd7 || cp == 0xf7 ? Separator : Letter;
+    }
+
+    // General punctuation up to miscellaneous symbols and arrows
+    if (cp >= 0x2000 && cp < 0x2c00) {
+        return Separator;
+    }
+    if (cp >= 0x2e00 && cp < 0x2e80) {
+        return Separator;
+    }
+    // CJK symbols and punctuation
+    if (cp >= 0x3000 && cp < 0x3040) {
+        return Separator;
+    }
+    // Kana, CJK unified ideographs and their extensions
+    if ((cp >= 0x3040 && cp < 0x3100) || (cp >= 0x3400 && cp < 0x4dc0) ||
+            (cp >= 0x4e00 && cp < 0xa000) || (cp >= 0xf900 && cp < 0xfb00) ||
+            (cp >= 0x20000 && cp < 0x40000)) {
+        return Ideograph;
+    }
+    // Private use area
+    if (cp >= 0xe000 && cp < 0xf900) {
+        return Separator;
+    }
+    // CJK compatibility forms and the fullwidth punctuation
+    if ((cp >= 0xfe30 && cp < 0xfe50) || (cp >= 0xff00 && cp < 0xff10) ||
+            (cp >= 0xff1a && cp < 0xff21) || (cp >= 0xff3b && cp < 0xff41) ||
+            (cp >= 0xff5b && cp < 0xff66)) {
+        return Separator;
+    }
+    // Emoji and other pictographs
+    if (cp >= 0x1f000 && cp < 0x1fb00) {
+        return Separator;
+    }
+
+    return Letter;
+}
+
+static uint32_t fold(uint32_t cp) {
+    if (cp >= 0xc0 && cp <= 0xde && cp != 0xd7) {
+        return cp + 0x20;
+    }
+
+    // Latin Extended-A comes in pairs, though not all aligned the same way;
+    // the dotted capital I has no lowercase counterpart of its own
+    if ((cp >= 0x100 && cp < 0x138 && cp != 0x130) || (cp >= 0x14a && cp < 0x178)) {
+        return cp | 1;
+    }
+    if ((cp >= 0x139 && cp < 0x149) || (cp >= 0x179 && cp < 0x17f)) {
+        return cp + (cp & 1);
+    }
+
+    if (cp >= 0x391 && cp <= 0x3a9 && cp != 0x3a2) {
+        return cp + 0x20;
+    }
+    if (cp >= 0x410 && cp < 0x430) {
+        return cp + 0x20;
+    }
+    if (cp >= 0x400 && cp < 0x410) {
+        return cp + 0x50;
+    }
+
+    return cp;
+}
+
+// Returns the length of the code point at p, or 0 if it is not valid UTF-8
+static size_t decode(const unsigned char *p, const unsigned char *end, uint32_t &cp) {
+    size_t len;
+    uint32_t min;
+    if (*p >= 0xc2 && *p < 0xe0) {
+        len = 2;
+        cp = *p & 0x1f;
+        min = 0x80;
+    } else if (*p >= 0xe0 && *p < 0xf0) {
+        len = 3;
+        cp = *p & 0x0f;
+        min = 0x800;
+    } else if (*p >= 0xf0 && *p < 0xf5) {
+        len = 4;
+        cp = *p & 0x07;
+        min = 0x10000;
+    } else {
+        return 0;
+    }
+
+    if (static_cast<size_t>(end - p) < len) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (p[i] & 0x3f);
+    }
+
+    if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp < 0xe000)) {
+        return 0;
+    }
+    return len;
+}
+
+static void encode(uint32_t cp, size_t len, char *out) {
+    static const unsigned char leads[] = {0, 0, 0xc0, 0xe0, 0xf0};
+    for (size_t i = len - 1; i > 0; i--) {
+        out[i] = static_cast<char>(0x80 | (cp & 0x3f));
+        cp >>= 6;
+    }
+    out[0] = static_cast<char>(leads[len] | cp);
+}
+
+static inline bool is_ascii_word(unsigned char c) {
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+TextTokenizer::TextTokenizer(bool _fold_case) {
+    fold_case = _fold_case;
+}
+
+void TextTokenizer::tokenize(std::string_view text, std::vector<std::string_view> &tokens) {
+    tokens.clear();
+
+    // The words are never longer than the text, so the buffer is not
+    // reallocated while the views into it are being made
+    if (buffer.size() < text.size()) {
+        buffer.resize(text.size());
+    }
+    char *out = &buffer[0];
+    size_t out_len = 0;
+    size_t word_start = 0;
+    bool in_word = false;
+
+    auto end_word = [&] {
+        if (in_word) {
+            tokens.emplace_back(out + word_start, out_len - word_start);
+            in_word = false;
+        }
+    };
+
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(text.data());
+    const unsigned char *end = p + text.size();
+    while (p < end) {
+        unsigned char c = *p;
+        if (c < 0x80) {
+            if (is_ascii_word(c)) {
+                if (!in_word) {
+                    word_start = out_len;
+                    in_word = true;
+                }
+                out[out_len++] = fold_case && c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+            } else {
+                end_word();
+            }
+            p++;
+            continue;
+        }
+
+        uint32_t cp;
+        size_t len = decode(p, end, cp);
+        if (!len) {
+            end_word();
+            p++;
+            continue;
+        }
+
+        switch (classify(cp)) {
+            case Separator:
+                end_word();
+                break;
+            case Ideograph:
+                end_word();
+                tokens.emplace_back(out + out_len, len);
+                encode(cp, len, out + out_len);
+                out_len += len;
+                break;
+            case Letter:
+                if (!in_word) {
+                    word_start = out_len;
+                    in_word = true;
+                }
+                encode(fold_case ? fold(cp) : cp, len, out + out_len);
+                out_len += len;
+                break;
+        }
+        p += len;
+    }
+    end_word();
+}
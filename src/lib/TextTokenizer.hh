@@ -0,0 +1,33 @@
+#ifndef __TEXTTOKENIZER_HH
+#define __TEXTTOKENIZER_HH
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Splits UTF-8 text into words.  A word is a run of letters and digits, where
+ * every code point outside of the ASCII, Latin-1 and general punctuation and
+ * symbol blocks counts as a letter.  Ideographs and kana are not separated by
+ * spaces in writing, so each of them is a word of its own.  Bytes which are
+ * not valid UTF-8 separate words.
+ *
+ * With case folding, the ASCII, Latin-1, Latin Extended-A, Greek and Cyrillic
+ * capitals are lowercased; none of these change their encoded length.
+ */
+class TextTokenizer {
+  private:
+    bool fold_case;
+    std::string buffer;
+
+  public:
+    explicit TextTokenizer(bool fold_case = true);
+
+    /**
+     * Replaces the contents of tokens with the words of the text.  The views
+     * point into the tokenizer, and are valid until the next call.
+     */
+    void tokenize(std::string_view text, std::vector<std::string_view> &tokens);
+};
+
+#endif /* __TEXTTOKENIZER_HH */
@@ -0,0 +1,69 @@
+#include "ThreadPool.hh"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+    }
+    task_available.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::work() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            task_available.wait(guard, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+
+        task();
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            pending--;
+        }
+        task_done.notify_all();
+    }
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task) {
+    // std::function needs a copyable target, which std::packaged_task isn't
+    std::shared_ptr<std::packaged_task<void()>> packaged =
+        std::make_shared<std::packaged_task<void()>>(std::move(task));
+    std::future<void> result = packaged->get_future();
+
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        tasks.push([packaged] { (*packaged)(); });
+        pending++;
+    }
+    task_available.notify_one();
+    return result;
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    task_done.wait(guard, [this] { return pending == 0; });
+}
@@ -0,0 +1,91 @@
+#ifndef __THREADPOOL_HH
+#define __THREADPOOL_HH
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads executing the submitted tasks in the order of
+ * submission.
+ */
+class ThreadPool {
+  private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable task_available;
+    std::condition_variable task_done;
+    size_t pending = 0;
+    bool stopping = false;
+
+    void work();
+
+  public:
+    /**
+     * Starts the specified number of threads; zero means one per core.
+     */
+    explicit ThreadPool(unsigned threads = 0);
+    ThreadPool(ThreadPool const&) = delete;
+    ~ThreadPool();
+
+    inline unsigned size() const { return workers.size(); }
+
+    /**
+     * Queues the task.  The future becomes ready when it has finished, and
+     * carries the exception if it has thrown one.
+     */
+    std::future<void> submit(std::function<void()> task);
+
+    /**
+     * Blocks until every task submitted so far has finished.
+     */
+    void wait();
+};
+
+/**
+ * Work items processed on a pool and taken back in the order of submission,
+ * as the parallel stages of the dump pipelines need.  The producer should
+ * stop submitting while full(), which bounds both the memory held by the
+ * items and how far it gets ahead of the consumer.
+ */
+template <typename T>
+class OrderedTasks {
+  private:
+    ThreadPool &pool;
+    std::deque<std::pair<std::shared_ptr<T>, std::shared_future<void>>> in_flight;
+
+  public:
+    explicit OrderedTasks(ThreadPool &_pool) : pool(_pool) {}
+    OrderedTasks(OrderedTasks const&) = delete;
+
+    inline bool empty() const { return in_flight.empty(); }
+    inline size_t size() const { return in_flight.size(); }
+    inline bool full() const { return in_flight.size() >= 2 * pool.size(); }
+
+    /**
+     * Runs the function on the item on one of the threads of the pool.
+     */
+    void submit(std::shared_ptr<T> item, std::function<void(T &)> fn) {
+        in_flight.emplace_back(item, pool.submit([item, fn] { fn(*item); }).share());
+    }
+
+    /**
+     * Waits for the oldest item to be processed and returns it.  Rethrows
+     * the exception if processing has thrown one.
+     */
+    T &front() {
+        in_flight.front().second.get();
+        return *in_flight.front().first;
+    }
+
+    void pop() { in_flight.pop_front(); }
+};
+
+#endif /* __THREADPOOL_HH */
@@ -0,0 +1,406 @@
+#include "TokenCounter.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <queue>
+#include <system_error>
+
+#include "TextTokenizer.hh"
+#include "ThreadPool.hh"
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define INITIAL_SLOTS 1024
+#define BATCH_REVISIONS 256
+#define BATCH_TEXT_SIZE (8 * 1024 * 1024)
+// A shard with this many runs has them merged into one, which keeps the
+// number of open files bounded whatever the size of the input
+#define MAX_RUNS_PER_SHARD 4
+
+/*************************** MergeCursor ***************************/
+// Walks one sorted source of (key, count) pairs: either a spilled run, or
+// the sorted contents of a shard
+class TokenCounter::MergeCursor {
+  private:
+    std::vector<Entry> entries;
+    size_t position = 0;
+    FILE *run = nullptr;
+    std::string key_buffer;
+
+  public:
+    std::string_view key;
+    uint64_t count;
+
+    MergeCursor(std::vector<Entry> &&_entries) : entries(std::move(_entries)) {}
+
+    MergeCursor(FILE *_run) : run(_run) {
+        fseek(run, 0, SEEK_SET);
+    }
+
+    bool next() {
+        if (!run) {
+            if (position == entries.size()) {
+                return false;
+            }
+            key = StringTable::stored_string(entries[position].key);
+            count = entries[position].value;
+            position++;
+            return true;
+        }
+
+        uint32_t len;
+        if (fread(&len, sizeof(len), 1, run) != 1) {
+            if (ferror(run)) {
+                throw std::system_error(errno, std::generic_category(), "cannot read run file");
+            }
+            return false;
+        }
+        key_buffer.resize(len);
+        if ((len > 0 && fread(&key_buffer[0], len, 1, run) != 1) ||
+                fread(&count, sizeof(count), 1, run) != 1) {
+            throw std::system_error(ferror(run) ? errno : EIO, std::generic_category(),
+                                    "truncated run file");
+        }
+        key = key_buffer;
+        return true;
+    }
+};
+
+// Merges the sorted sources, and calls the function for every key with its
+// total count, in the order of the keys
+void TokenCounter::merge_cursors(std::vector<std::unique_ptr<MergeCursor>> &cursors,
+                                 const std::function<void(std::string_view, uint64_t)> &fn) {
+    auto later = [&cursors](size_t a, size_t b) {
+        return cursors[a]->key > cursors[b]->key;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+    for (size_t i = 0; i < cursors.size(); i++) {
+        if (cursors[i]->next()) {
+            heap.push(i);
+        }
+    }
+
+    std::string key;
+    while (!heap.empty()) {
+        size_t i = heap.top();
+        heap.pop();
+        key.assign(cursors[i]->key);
+        uint64_t count = cursors[i]->count;
+        if (cursors[i]->next()) {
+            heap.push(i);
+        }
+
+        // The same key may come from several runs of the shard
+        while (!heap.empty() && cursors[heap.top()]->key == key) {
+            i = heap.top();
+            heap.pop();
+            count += cursors[i]->count;
+            if (cursors[i]->next()) {
+                heap.push(i);
+            }
+        }
+
+        fn(key, count);
+    }
+}
+
+static FILE *create_run() {
+    FILE *run = tmpfile();
+    if (!run) {
+        throw std::system_error(errno, std::generic_category(), "cannot create run file");
+    }
+    return run;
+}
+
+static void write_run_entry(FILE *run, std::string_view key, uint64_t count) {
+    uint32_t len = key.size();
+    if (fwrite(&len, sizeof(len), 1, run) != 1 ||
+            (len > 0 && fwrite(key.data(), len, 1, run) != 1) ||
+            fwrite(&count, sizeof(count), 1, run) != 1) {
+        throw std::system_error(errno, std::generic_category(), "cannot write run file");
+    }
+}
+
+static void finish_run(FILE *run) {
+    if (fflush(run) != 0) {
+        throw std::system_error(errno, std::generic_category(), "cannot write run file");
+    }
+}
+
+/*************************** TokenCounter ***************************/
+TokenCounter::TokenCounter(size_t memory_budget, unsigned shard_count) {
+    shard_bits = 0;
+    while ((1u << shard_bits) < shard_count) {
+        shard_bits++;
+    }
+
+    for (unsigned i = 0; i < (1u << shard_bits); i++) {
+        shards.emplace_back(new Shard());
+    }
+    shard_budget = memory_budget >> shard_bits;
+}
+
+TokenCounter::~TokenCounter() {
+    for (const std::unique_ptr<Shard> &shard : shards) {
+        for (FILE *run : shard->runs) {
+            fclose(run);
+        }
+    }
+}
+
+TokenCounter::Shard::Shard() : table(ARENA_BLOCK_SIZE, INITIAL_SLOTS) {}
+
+std::vector<TokenCounter::Entry> TokenCounter::sorted_entries(const Shard &shard) {
+    std::vector<Entry> sorted;
+    sorted.reserve(shard.table.size());
+    for (const Entry &entry : shard.table.table()) {
+        if (entry.key) {
+            sorted.push_back(entry);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const Entry &a, const Entry &b) {
+        return StringTable::stored_string(a.key) < StringTable::stored_string(b.key);
+    });
+    return sorted;
+}
+
+void TokenCounter::spill(Shard &shard) {
+    std::vector<Entry> sorted = sorted_entries(shard);
+
+    FILE *run = create_run();
+    try {
+        for (const Entry &entry : sorted) {
+            write_run_entry(run, StringTable::stored_string(entry.key), entry.value);
+        }
+        finish_run(run);
+    } catch (...) {
+        fclose(run);
+        throw;
+    }
+    shard.runs.push_back(run);
+
+    shard.table.clear();
+
+    if (shard.runs.size() >= MAX_RUNS_PER_SHARD) {
+        merge_runs(shard);
+    }
+}
+
+void TokenCounter::merge_runs(Shard &shard) {
+    std::vector<std::unique_ptr<MergeCursor>> cursors;
+    for (FILE *run : shard.runs) {
+        cursors.emplace_back(new MergeCursor(run));
+    }
+
+    FILE *merged = create_run();
+    try {
+        merge_cursors(cursors, [merged](std::string_view key, uint64_t count) {
+            write_run_entry(merged, key, count);
+        });
+        finish_run(merged);
+    } catch (...) {
+        fclose(merged);
+        throw;
+    }
+
+    for (FILE *run : shard.runs) {
+        fclose(run);
+    }
+    shard.runs.assign(1, merged);
+}
+
+void TokenCounter::add(const std::vector<std::string_view> &keys) {
+    // Group the keys by shard first, so that every lock is taken only once
+    size_t shard_count = shards.size();
+    std::vector<uint64_t> hashes(keys.size());
+    std::vector<size_t> starts(shard_count + 1, 0);
+    auto shard_of = [this](uint64_t hash) -> size_t {
+        return shard_bits ? hash >> (64 - shard_bits) : 0;
+    };
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        hashes[i] = hash_string(keys[i]);
+        starts[shard_of(hashes[i]) + 1]++;
+    }
+    for (size_t s = 0; s < shard_count; s++) {
+        starts[s + 1] += starts[s];
+    }
+
+    std::vector<size_t> order(keys.size());
+    std::vector<size_t> fill(starts.begin(), starts.end() - 1);
+    for (size_t i = 0; i < keys.size(); i++) {
+        order[fill[shard_of(hashes[i])]++] = i;
+    }
+
+    for (size_t s = 0; s < shard_count; s++) {
+        if (starts[s] == starts[s + 1]) {
+            continue;
+        }
+
+        Shard &shard = *shards[s];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for (size_t j = starts[s]; j < starts[s + 1]; j++) {
+            shard.table.insert(hashes[order[j]], keys[order[j]]).value++;
+        }
+        if (shard.table.memory_usage() > shard_budget) {
+            spill(shard);
+        }
+    }
+}
+
+size_t TokenCounter::spilled_runs() const {
+    size_t runs = 0;
+    for (const std::unique_ptr<Shard> &shard : shards) {
+        runs += shard->runs.size();
+    }
+    return runs;
+}
+
+void TokenCounter::merge(const std::vector<Shard *> &sources,
+                         const std::function<void(std::string_view, uint64_t)> &fn) const {
+    std::vector<std::unique_ptr<MergeCursor>> cursors;
+    for (Shard *shard : sources) {
+        cursors.emplace_back(new MergeCursor(sorted_entries(*shard)));
+
+        for (FILE *run : shard->runs) {
+            cursors.emplace_back(new MergeCursor(run));
+        }
+    }
+
+    merge_cursors(cursors, fn);
+}
+
+void TokenCounter::for_each(std::function<void(std::string_view, uint64_t)> fn) const {
+    std::vector<Shard *> sources;
+    for (const std::unique_ptr<Shard> &shard : shards) {
+        sources.push_back(shard.get());
+    }
+    merge(sources, fn);
+}
+
+std::vector<std::pair<std::string, uint64_t>> TokenCounter::top(size_t k, unsigned threads) const {
+    typedef std::pair<std::string, uint64_t> Result;
+
+    // Higher counts first, and the keys in order among the equal ones
+    auto better = [](const Result &a, const Result &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    };
+
+    // The shards hold disjoint sets of keys, so each one can be merged on
+    // its own, and only its best k keys kept
+    std::vector<std::vector<Result>> shard_results(shards.size());
+    {
+        ThreadPool pool(threads);
+        for (size_t s = 0; s < shards.size(); s++) {
+            pool.submit([this, s, k, &shard_results, &better] {
+                std::priority_queue<Result, std::vector<Result>, decltype(better)> worst(better);
+                merge({shards[s].get()}, [&worst, k, &better](std::string_view key, uint64_t count) {
+                    if (worst.size() < k) {
+                        worst.emplace(std::string(key), count);
+                    } else if (k > 0 && (count > worst.top().second ||
+                                         (count == worst.top().second && key < worst.top().first))) {
+                        worst.pop();
+                        worst.emplace(std::string(key), count);
+                    }
+                });
+
+                while (!worst.empty()) {
+                    shard_results[s].push_back(worst.top());
+                    worst.pop();
+                }
+            });
+        }
+        pool.wait();
+    }
+
+    std::vector<Result> results;
+    for (std::vector<Result> &shard_result : shard_results) {
+        std::move(shard_result.begin(), shard_result.end(), std::back_inserter(results));
+    }
+    std::sort(results.begin(), results.end(), better);
+    if (results.size() > k) {
+        results.resize(k);
+    }
+    return results;
+}
+
+/*************************** count_dump_ngrams ***************************/
+struct NgramBatch {
+    std::vector<MediaWikiRevision_s> revisions;
+};
+
+static void count_batch(const NgramBatch &batch, TokenCounter &counter,
+                        const NgramCountOptions &options) {
+    TextTokenizer tokenizer(options.fold_case);
+    std::vector<std::string_view> words;
+
+    // The n-grams of the whole batch are collected first, so that they are
+    // added to the counter at once
+    std::string storage;
+    std::vector<std::pair<size_t, size_t>> spans;
+
+    for (const MediaWikiRevision_s &rev : batch.revisions) {
+        tokenizer.tokenize(std::string_view(rev->get_text_ptr(), rev->get_text_size()), words);
+        if (words.size() < options.n) {
+            continue;
+        }
+
+        for (size_t i = 0; i + options.n <= words.size(); i++) {
+            size_t start = storage.size();
+            for (size_t j = i; j < i + options.n; j++) {
+                if (j > i) {
+                    storage.push_back(' ');
+                }
+                storage.append(words[j]);
+            }
+            spans.emplace_back(start, storage.size() - start);
+        }
+    }
+
+    std::vector<std::string_view> keys;
+    keys.reserve(spans.size());
+    for (const std::pair<size_t, size_t> &span : spans) {
+        keys.emplace_back(storage.data() + span.first, span.second);
+    }
+    counter.add(keys);
+}
+
+void count_dump_ngrams(XMLDumpParser &parser, TokenCounter &counter,
+                       const NgramCountOptions &options, unsigned threads) {
+    assert(options.n > 0);
+
+    ThreadPool pool(threads);
+    OrderedTasks<NgramBatch> batches(pool);
+
+    bool finished = false;
+    while (!finished) {
+        std::shared_ptr<NgramBatch> batch = std::make_shared<NgramBatch>();
+        size_t text_size = 0;
+        while (batch->revisions.size() < BATCH_REVISIONS && text_size < BATCH_TEXT_SIZE) {
+            MediaWikiRevision_s rev = options.latest_only ? parser.read_latest_revision()
+                                                           : parser.read_revision();
+            if (!rev) {
+                finished = true;
+                break;
+            }
+            text_size += rev->get_text_size();
+            batch->revisions.push_back(std::move(rev));
+        }
+
+        batches.submit(batch, [&counter, &options](NgramBatch &batch) {
+            count_batch(batch, counter, options);
+        });
+
+        while (batches.full()) {
+            batches.front();
+            batches.pop();
+        }
+    }
+
+    while (!batches.empty()) {
+        batches.front();
+        batches.pop();
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef __TOKENCOUNTER_HH
+#define __TOKENCOUNTER_HH
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "StringTable.hh"
+#include "XMLDumpParser.hh"
+
+/**
+ * Counts the occurrences of strings added from any number of threads.
+ *
+ * The keys are spread over shards by their hash, each with a lock and a
+ * StringTable holding the keys and their counts.  Adding a whole
+ * batch of keys at once takes every lock only once.  When a shard grows over
+ * its share of the memory budget, its contents are written out as a run
+ * sorted by key to an anonymous temporary file, and the shard starts over.
+ * Once a shard has a few runs, they are merged into a single one, so that
+ * the open files stay few.  The results are produced by merging the runs
+ * with what is still in memory.
+ */
+class TokenCounter {
+  private:
+    typedef StringTable::Slot Entry;
+
+    struct Shard {
+        std::mutex lock;
+        // The values are the counts
+        StringTable table;
+        std::vector<FILE *> runs;
+
+        Shard();
+    };
+
+    class MergeCursor;
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    unsigned shard_bits;
+    size_t shard_budget;
+
+    static std::vector<Entry> sorted_entries(const Shard &shard);
+    void spill(Shard &shard);
+    void merge_runs(Shard &shard);
+    static void merge_cursors(std::vector<std::unique_ptr<MergeCursor>> &cursors,
+                              const std::function<void(std::string_view, uint64_t)> &fn);
+    void merge(const std::vector<Shard *> &sources,
+               const std::function<void(std::string_view, uint64_t)> &fn) const;
+
+  public:
+    /**
+     * The number of shards is rounded up to a power of two.  Besides the
+     * budget, the merge needs a buffer per run, and there are at most four
+     * runs per shard, as more of them are merged into one.
+     */
+    explicit TokenCounter(size_t memory_budget = 1024 * 1024 * 1024, unsigned shards = 64);
+    TokenCounter(TokenCounter const&) = delete;
+    ~TokenCounter();
+
+    /**
+     * Counts every key once.  Safe to call from several threads.
+     */
+    void add(const std::vector<std::string_view> &keys);
+
+    size_t spilled_runs() const;
+
+    /**
+     * Calls the function for every key with its total count, in the order of
+     * the keys' bytes.  Must not run concurrently with add().
+     */
+    void for_each(std::function<void(std::string_view, uint64_t)> fn) const;
+
+    /**
+     * Returns the k keys with the highest counts, highest first.  The shards
+     * are merged on the specified number of threads.  Must not run
+     * concurrently with add().
+     */
+    std::vector<std::pair<std::string, uint64_t>> top(size_t k, unsigned threads = 0) const;
+};
+
+struct NgramCountOptions {
+    // Length of the n-grams; 1 counts words
+    unsigned n = 1;
+    bool fold_case = true;
+    // Count only the latest revision of each page instead of all of them
+    bool latest_only = true;
+};
+
+/**
+ * Tokenizes the revisions of the dump, which has to be opened in the
+ * PerRevision mode, on the specified number of threads, and adds their
+ * n-grams to the counter.  The words of an n-gram are joined by spaces.
+ */
+void count_dump_ngrams(XMLDumpParser &parser, TokenCounter &counter,
+                       const NgramCountOptions &options, unsigned threads = 0);
+
+#endif /* __TOKENCOUNTER_HH */
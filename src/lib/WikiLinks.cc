@@ -0,0 +1,230 @@
+#include "WikiLinks.hh"
+
+#include <memory>
+
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ThreadPool.hh"
+
+#define MAX_NESTING 64
+#define BATCH_REVISIONS 256
+#define BATCH_TEXT_SIZE (16 * 1024 * 1024)
+
+namespace {
+    enum OpenKind {
+        OpenLink,
+        OpenTemplate,
+        // {{{parameter}}} of a template definition
+        OpenParameter
+    };
+
+    struct OpenElement {
+        OpenKind kind;
+        size_t start;
+        size_t pipe;
+    };
+}
+
+static const size_t no_pipe = SIZE_MAX;
+
+static inline bool is_markup(char c) {
+    return c == '[' || c == ']' || c == '{' || c == '}' || c == '|';
+}
+
+// Returns the position of the first markup character at or after pos
+static inline size_t find_markup(const char *text, size_t pos, size_t size) {
+#ifdef __SSE2__
+    // Setting bit 5 turns "[" into "{" and "]" into "}", and nothing else
+    // into either, which saves two of the comparisons
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i pipe = _mm_set1_epi8('|');
+
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + pos));
+        __m128i folded = _mm_or_si128(chunk, case_bit);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, open),
+                                                 _mm_cmpeq_epi8(folded, close)),
+                                    _mm_cmpeq_epi8(chunk, pipe));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    while (pos < size && !is_markup(text[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static std::string_view trim(std::string_view str) {
+    while (!str.empty() && is_space(str.front())) {
+        str.remove_prefix(1);
+    }
+    while (!str.empty() && is_space(str.back())) {
+        str.remove_suffix(1);
+    }
+    return str;
+}
+
+static void emit(std::string_view text, const OpenElement &element, size_t end,
+                 uint32_t depth, std::vector<WikiLinkSpan> &out) {
+    size_t target_end = element.pipe == no_pipe ? end : element.pipe;
+    std::string_view target = trim(text.substr(element.start, target_end - element.start));
+    if (target.empty()) {
+        return;
+    }
+
+    std::string_view anchor;
+    if (element.pipe != no_pipe) {
+        anchor = text.substr(element.pipe + 1, end - element.pipe - 1);
+    }
+
+    WikiLinkKind kind = WikiTemplate;
+    if (element.kind == OpenLink) {
+        // A leading colon makes it a link to the category instead
+        const char prefix[] = "category:";
+        const size_t prefix_len = sizeof(prefix) - 1;
+        bool category = target.size() > prefix_len &&
+                        !strncasecmp(target.data(), prefix, prefix_len);
+        kind = category ? WikiCategory : WikiLink;
+    }
+
+    out.push_back({kind, depth, target, anchor});
+}
+
+void extract_wiki_links(std::string_view text, std::vector<WikiLinkSpan> &out) {
+    OpenElement stack[MAX_NESTING];
+    size_t depth = 0;
+
+    const char *data = text.data();
+    size_t size = text.size();
+
+    // Ends the innermost open element of the kind, if there is one
+    auto close = [&](OpenKind kind, size_t end) -> bool {
+        for (size_t i = depth; i-- > 0;) {
+            if (stack[i].kind == kind) {
+                depth = i;
+                if (kind != OpenParameter) {
+                    emit(text, stack[i], end, depth, out);
+                }
+                return true;
+            }
+        }
+        return false;
+    };
+
+    size_t pos = find_markup(data, 0, size);
+    while (pos < size) {
+        char c = data[pos];
+        if (c == '|') {
+            if (depth > 0 && stack[depth - 1].pipe == no_pipe) {
+                stack[depth - 1].pipe = pos;
+            }
+            pos = find_markup(data, pos + 1, size);
+            continue;
+        }
+
+        // Only the doubled brackets mean anything
+        if (pos + 1 >= size || data[pos + 1] != c) {
+            pos = find_markup(data, pos + 1, size);
+            continue;
+        }
+
+        bool tripled = pos + 2 < size && data[pos + 2] == c;
+        size_t len = 2;
+        switch (c) {
+            case '[':
+            case '{': {
+                OpenKind kind = c == '[' ? OpenLink : OpenTemplate;
+                if (c == '{' && tripled) {
+                    kind = OpenParameter;
+                    len = 3;
+                }
+                // Anything nested deeper than this is garbage anyway
+                if (depth < MAX_NESTING) {
+                    stack[depth++] = {kind, pos + len, no_pipe};
+                }
+                break;
+            }
+            case ']':
+                close(OpenLink, pos);
+                break;
+            case '}':
+                if (tripled && depth > 0 && stack[depth - 1].kind == OpenParameter) {
+                    close(OpenParameter, pos);
+                    len = 3;
+                } else {
+                    close(OpenTemplate, pos);
+                }
+                break;
+        }
+
+        pos = find_markup(data, pos + len, size);
+    }
+}
+
+/*************************** extract_dump_links ***************************/
+struct LinkBatch {
+    std::vector<MediaWikiRevision_s> revisions;
+    std::vector<std::vector<WikiLinkSpan>> links;
+};
+
+void extract_dump_links(XMLDumpParser &parser, unsigned threads, WikiLinkCallback fn,
+                        bool latest_only) {
+    ThreadPool pool(threads);
+    OrderedTasks<LinkBatch> batches(pool);
+
+    auto deliver = [&batches, &fn] {
+        LinkBatch &batch = batches.front();
+        for (size_t i = 0; i < batch.revisions.size(); i++) {
+            fn(batch.revisions[i], batch.links[i]);
+        }
+        batches.pop();
+    };
+
+    bool finished = false;
+    while (!finished) {
+        // Batch by the amount of text, as the revisions vary in size wildly
+        std::shared_ptr<LinkBatch> batch = std::make_shared<LinkBatch>();
+        size_t text_size = 0;
+        while (batch->revisions.size() < BATCH_REVISIONS && text_size < BATCH_TEXT_SIZE) {
+            MediaWikiRevision_s rev = latest_only ? parser.read_latest_revision()
+                                                  : parser.read_revision();
+            if (!rev) {
+                finished = true;
+                break;
+            }
+            text_size += rev->get_text_size();
+            batch->revisions.push_back(std::move(rev));
+        }
+
+        batches.submit(batch, [](LinkBatch &batch) {
+            batch.links.resize(batch.revisions.size());
+            for (size_t i = 0; i < batch.revisions.size(); i++) {
+                const MediaWikiRevision &rev = *batch.revisions[i];
+                extract_wiki_links(std::string_view(rev.get_text_ptr(), rev.get_text_size()),
+                                   batch.links[i]);
+            }
+        });
+
+        while (batches.full()) {
+            deliver();
+        }
+    }
+
+    while (!batches.empty()) {
+        deliver();
+    }
+}
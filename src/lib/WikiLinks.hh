@@ -0,0 +1,57 @@
+#ifndef __WIKILINKS_HH
+#define __WIKILINKS_HH
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+#include "XMLDumpParser.hh"
+
+enum WikiLinkKind {
+    WikiLink,
+    WikiTemplate,
+    WikiCategory
+};
+
+/**
+ * A [[link]], {{template}} or [[Category:...]] within the wikitext.  Both
+ * views point into the revision text, and are only valid as long as it is.
+ *
+ * The target is the text up to the first "|" with the surrounding whitespace
+ * trimmed, but otherwise as written: no case folding, no underscores turned
+ * into spaces, and no "#fragment" removed.  The anchor is everything after
+ * the first "|", which is the label of a link, the sort key of a category and
+ * the parameters of a template.  The depth is the number of links and
+ * templates enclosing this one.
+ */
+struct WikiLinkSpan {
+    WikiLinkKind kind;
+    uint32_t depth;
+    std::string_view target;
+    std::string_view anchor;
+};
+
+/**
+ * Appends the links and templates found in the text to out, in the order in
+ * which they end, so the nested ones come before those containing them.
+ * Unbalanced brackets are skipped the way they would be rendered: a closing
+ * pair ends the innermost element of its kind, and drops anything left open
+ * inside it.  The contents of <nowiki> and comments are not special.
+ */
+void extract_wiki_links(std::string_view text, std::vector<WikiLinkSpan> &out);
+
+typedef std::function<void(const MediaWikiRevision_s &, const std::vector<WikiLinkSpan> &)>
+    WikiLinkCallback;
+
+/**
+ * Reads every revision of the dump, which has to be opened in the PerRevision
+ * mode, and calls the function with its links.  The extraction runs on the
+ * specified number of threads, but the function is always called from the
+ * calling thread, in the order of the dump.  With latest_only, only the
+ * latest revision of each page is read.
+ */
+void extract_dump_links(XMLDumpParser &parser, unsigned threads, WikiLinkCallback fn,
+                        bool latest_only = false);
+
+#endif /* __WIKILINKS_HH */
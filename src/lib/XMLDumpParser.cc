@@ -1,13 +1,20 @@
 #include "XMLDumpParser.hh"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cstdlib>
 #include <cstring>
+#include <new>
+
+#include <sys/mman.h>
+
+#include "NumericParsing.hh"
 
 extern "C" {
     void handleStartElement_redir(void *user_data, const XML_Char *name, const XML_Char **attrs) {
         XMLDumpParser *p = static_cast<XMLDumpParser*>(user_data);
-        p->handleStartElement(name);
+        p->handleStartElement(name, attrs);
     }
 
     void handleEndElement_redir(void *user_data, const XML_Char *name) {
@@ -21,15 +28,183 @@ extern "C" {
     }
 }
 
-XMLDumpParser::XMLDumpParser(const char *path, XMLDumpParserMode _mode) {
-    input = open_compressed_dump(path);
-    assert(input);
+// Expat rounds its buffer up to the next power of two above the length
+// asked for plus some context, and keeps the size in an int
+#define MAX_BUFFER_SIZE (1ull << 29)
+
+// Asking Expat for no buffer at all would read as the end of the dump
+static size_t clamp_buffer_size(unsigned long long size) {
+    return std::min(std::max(1ull, size), MAX_BUFFER_SIZE);
+}
+
+XMLDumpParserOptions &default_xml_dump_parser_options() {
+    static XMLDumpParserOptions options = [] {
+        XMLDumpParserOptions result;
+
+        if (const char *size = getenv("MWDUMP_XML_BUFFER_SIZE")) {
+            result.buffer_size = clamp_buffer_size(strtoull(size, nullptr, 10));
+        }
+        if (const char *huge_pages = getenv("MWDUMP_XML_HUGE_PAGES")) {
+            result.huge_pages = strcmp(huge_pages, "0") != 0;
+        }
+
+        return result;
+    }();
+    return options;
+}
+
+/*************************** Expat memory ***************************/
+// Expat's allocator callbacks get no user data, so the size of every block
+// is kept in a header in front of it.  Anything of at least a huge page goes
+// straight to mmap() with MADV_HUGEPAGE, the rest to malloc().
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+struct alignas(16) ExpatBlockHeader {
+    size_t capacity;
+    bool mapped;
+};
+
+static void *expat_malloc(size_t size) {
+    size_t total = sizeof(ExpatBlockHeader) + size;
+    ExpatBlockHeader *header;
+
+    if (total >= HUGE_PAGE_SIZE) {
+        total = (total + HUGE_PAGE_SIZE - 1) & ~static_cast<size_t>(HUGE_PAGE_SIZE - 1);
+        void *map = mmap(nullptr, total, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return nullptr;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(map, total, MADV_HUGEPAGE);
+#endif
+        header = static_cast<ExpatBlockHeader *>(map);
+        header->mapped = true;
+    } else {
+        header = static_cast<ExpatBlockHeader *>(malloc(total));
+        if (!header) {
+            return nullptr;
+        }
+        header->mapped = false;
+    }
+
+    header->capacity = total - sizeof(ExpatBlockHeader);
+    return header + 1;
+}
+
+static void expat_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    ExpatBlockHeader *header = static_cast<ExpatBlockHeader *>(ptr) - 1;
+    if (header->mapped) {
+        munmap(header, sizeof(ExpatBlockHeader) + header->capacity);
+    } else {
+        free(header);
+    }
+}
+
+static void *expat_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return expat_malloc(size);
+    }
+
+    ExpatBlockHeader *header = static_cast<ExpatBlockHeader *>(ptr) - 1;
+    if (size <= header->capacity) {
+        return ptr;
+    }
+
+    size_t total = sizeof(ExpatBlockHeader) + size;
+    if (!header->mapped && total < HUGE_PAGE_SIZE) {
+        header = static_cast<ExpatBlockHeader *>(realloc(header, total));
+        if (!header) {
+            return nullptr;
+        }
+        header->capacity = size;
+        return header + 1;
+    }
+
+    void *result = expat_malloc(size);
+    if (result) {
+        memcpy(result, ptr, std::min(size, header->capacity));
+        expat_free(ptr);
+    }
+    return result;
+}
+
+static const XML_Memory_Handling_Suite huge_page_memory = {
+    expat_malloc,
+    expat_realloc,
+    expat_free
+};
+
+/*************************** XMLDumpParser ***************************/
+static CompressedDumpReader_u open_dump(const char *path, DumpRestartPoint restart,
+                                        const XMLDumpParserOptions &options) {
+    if (options.input) {
+        return open_compressed_dump(path, restart, *options.input);
+    }
+    return open_compressed_dump(path, restart);
+}
+
+XMLDumpParser::XMLDumpParser(const char *path, XMLDumpParserMode _mode,
+                             const XMLDumpParserOptions &options) {
+    input = open_dump(path, {0, 0}, options);
+    if (!input) {
+        throw XMLDumpError(std::string("cannot open ") + path);
+    }
+
+    mode = _mode;
+    init_parser(options);
+}
+
+XMLDumpParser::XMLDumpParser(const char *path, XMLDumpParserMode _mode,
+                             DumpRestartPoint restart, uint64_t offset,
+                             const XMLDumpParserOptions &options) {
+    assert(offset >= restart.uncompressed_offset);
+    input = open_dump(path, restart, options);
+    if (!input) {
+        throw XMLDumpError(std::string("cannot open ") + path);
+    }
 
     mode = _mode;
+    init_parser(options);
+
+    // Skip whatever precedes the page within the compressed stream, reading
+    // it into Expat's buffer without handing it over
+    uint64_t skip = offset - restart.uncompressed_offset;
+    while (skip > 0) {
+        size_t len = std::min<uint64_t>(skip, buffer_size);
+        char *scratch = static_cast<char *>(XML_GetBuffer(parser, len));
+        if (!scratch) {
+            throw std::bad_alloc();
+        }
+        ssize_t read = input->read(scratch, len);
+        if (read <= 0) {
+            XML_ParserFree(parser);
+            throw XMLDumpError(std::string(path) + " cannot be read up to offset " +
+                               std::to_string(offset));
+        }
+        skip -= read;
+    }
 
-    input_buffer = new char[buffer_size];
+    // The pages are not well-formed XML on their own, so pretend we are
+    // inside of the root element; the dump itself supplies the closing tag.
+    const char prefix[] = "<mediawiki>";
+    XML_Parse(parser, prefix, sizeof(prefix) - 1, false);
+    offset_base = static_cast<int64_t>(offset) - (sizeof(prefix) - 1);
+}
+
+void XMLDumpParser::init_parser(const XMLDumpParserOptions &options) {
+    buffer_size = clamp_buffer_size(options.buffer_size);
 
-    parser = XML_ParserCreate("utf-8");
+    if (options.huge_pages) {
+        parser = XML_ParserCreate_MM("utf-8", &huge_page_memory, nullptr);
+    } else {
+        parser = XML_ParserCreate("utf-8");
+    }
+    assert(parser);
     XML_SetUserData(parser, this);
     XML_SetElementHandler(parser, handleStartElement_redir, handleEndElement_redir);
     XML_SetCharacterDataHandler(parser, handleCharacterData_redir);
@@ -39,22 +214,54 @@ XMLDumpParser::XMLDumpParser(const char *path, XMLDumpParserMode _mode) {
 
 XMLDumpParser::~XMLDumpParser() {
     XML_ParserFree(parser);
-    delete[] input_buffer;
 }
 
 bool XMLDumpParser::drive() {
-    ssize_t read;
-    bool done;
+    // Finish the chunk we stopped in the middle of before reading a new one
+    if (suspended) {
+        suspended = parsed(XML_ResumeParser(parser), last_chunk);
+        return suspended || !last_chunk;
+    }
+
+    // Decompress directly into Expat's buffer, which saves copying every
+    // byte of the dump once more
+    void *buffer = XML_GetBuffer(parser, buffer_size);
+    if (!buffer) {
+        throw std::bad_alloc();
+    }
 
-    read = input->read(input_buffer, buffer_size);
+    ssize_t read = input->read(static_cast<char *>(buffer), buffer_size);
     if (read < 0) {
-        return false;
+        throw XMLDumpError("the dump is truncated or corrupt");
     }
 
-    done = read < buffer_size;
-    XML_Parse(parser, input_buffer, read, done);
-    assert(!done || state == Root);
-    return !done;
+    // The readers may return less than asked for at any time, so only
+    // reading nothing at all means the end of the dump
+    bool done = read == 0;
+    last_chunk = done;
+    suspended = parsed(XML_ParseBuffer(parser, read, done), done);
+    return suspended || !done;
+}
+
+bool XMLDumpParser::parsed(XML_Status status, bool done) {
+    if (status == XML_STATUS_ERROR) {
+        throw XMLDumpError("malformed XML at line " +
+                           std::to_string(XML_GetCurrentLineNumber(parser)) + ": " +
+                           XML_ErrorString(XML_GetErrorCode(parser)));
+    }
+    if (status == XML_STATUS_SUSPENDED) {
+        return true;
+    }
+    if (done && state != Root) {
+        throw XMLDumpError("the dump ends in the middle of a page");
+    }
+    return false;
+}
+
+void XMLDumpParser::suspend() {
+    if (mode == Streaming) {
+        XML_StopParser(parser, XML_TRUE);
+    }
 }
 
 bool XMLDumpParser::is_queue_empty() {
@@ -63,6 +270,8 @@ bool XMLDumpParser::is_queue_empty() {
             return pages.empty();
         case PerRevision:
             return revisions.empty();
+        case Streaming:
+            return pages.empty() && revisions.empty();
         default:
             assert(false);
     }
@@ -93,6 +302,69 @@ MediaWikiRevision_s XMLDumpParser::read_revision() {
     return result;
 }
 
+MediaWikiRevision_s XMLDumpParser::read_latest_revision() {
+    // The revisions of a page are consecutive, so the latest one is known to
+    // be the latest once a revision of another page comes along
+    while (MediaWikiRevision_s rev = read_revision()) {
+        bool next_page = latest_pending && latest_pending->get_page() != rev->get_page();
+        std::swap(rev, latest_pending);
+        if (next_page) {
+            return rev;
+        }
+    }
+
+    MediaWikiRevision_s last;
+    std::swap(last, latest_pending);
+    return last;
+}
+
+void XMLDumpParser::keep_restart_points() {
+    input->keep_restart_points();
+}
+
+DumpRestartPoint XMLDumpParser::restart_point_for(uint64_t offset) {
+    return input->restart_point_for(offset);
+}
+
+MediaWikiPage_s XMLDumpParser::next_page() {
+    assert(mode == Streaming);
+
+    // Drop whatever is left of the current page without keeping its text
+    skipped_page = stream_page;
+    while (next_revision()) {
+    }
+    skipped_page = nullptr;
+
+    // Revisions of a page only show up after the page itself
+    fill_queue();
+    if (pages.empty()) {
+        stream_page = nullptr;
+        return nullptr;
+    }
+
+    stream_page = pages.front();
+    pages.pop();
+    return stream_page;
+}
+
+MediaWikiRevision_s XMLDumpParser::next_revision() {
+    assert(mode == Streaming);
+
+    if (!stream_page) {
+        return nullptr;
+    }
+
+    // The page is over once the next one is announced or the input ends
+    fill_queue();
+    if (revisions.empty() || revisions.front()->page != stream_page) {
+        return nullptr;
+    }
+
+    MediaWikiRevision_s result = revisions.front();
+    revisions.pop();
+    return result;
+}
+
 MediaWikiPageHistory XMLDumpParser::read_page() {
     assert(mode == PerPage);
 
@@ -113,10 +385,12 @@ MediaWikiPageHistory XMLDumpParser::read_page() {
     return result;
 }
 
-void XMLDumpParser::handleStartElement(const XML_Char *name) {
+void XMLDumpParser::handleStartElement(const XML_Char *name, const XML_Char **attrs) {
     if (!strcmp(name, "page")) {
         assert(state == Root);
         current_page.reset(new MediaWikiPage());
+        current_page->offset = offset_base + XML_GetCurrentByteIndex(parser);
+        page_announced = false;
         state = Page;
         return;
     }
@@ -130,7 +404,7 @@ void XMLDumpParser::handleStartElement(const XML_Char *name) {
     if (!strcmp(name, "ns")) {
         assert(state == Page);
         state = Namespace;
-        accumulator = "";
+        start_number();
         return;
     }
 
@@ -145,7 +419,7 @@ void XMLDumpParser::handleStartElement(const XML_Char *name) {
         if (state == Contributor) {
             state = AuthorID;
         }
-        accumulator = "";
+        start_number();
         return;
     }
 
@@ -154,6 +428,13 @@ void XMLDumpParser::handleStartElement(const XML_Char *name) {
         current_revision.reset(new MediaWikiRevision());
         current_revision->page = current_page;
         state = Revision;
+
+        // By now, we know everything about the page itself
+        if (mode == Streaming && !page_announced) {
+            page_announced = true;
+            pages.push(current_page);
+            suspend();
+        }
         return;
     }
 
@@ -185,7 +466,46 @@ void XMLDumpParser::handleStartElement(const XML_Char *name) {
     if (!strcmp(name, "text")) {
         assert(state == Revision);
         state = Text;
+
+        // A stub states the size of the text it leaves out, while deleted
+        // text has no size and blanked text a size of zero
+        for (const XML_Char **attr = attrs; *attr; attr += 2) {
+            if (!strcmp(attr[0], "bytes")) {
+                current_revision->text_stub = strtoull(attr[1], nullptr, 10) > 0;
+            }
+        }
+    }
+}
+
+void XMLDumpParser::start_number() {
+    number_length = 0;
+}
+
+void XMLDumpParser::append_number(const XML_Char *text, int len) {
+    const XML_Char *end = text + len;
+    if (number_length == 0) {
+        while (text < end && isspace(static_cast<unsigned char>(*text))) {
+            text++;
+        }
     }
+
+    size_t count = std::min<size_t>(end - text, sizeof(number_text) - number_length);
+    memcpy(number_text + number_length, text, count);
+    number_length += count;
+}
+
+// Like atoi(): leading whitespace and trailing junk are ignored, and anything
+// without digits reads as 0, as does a value out of the range of the type
+template <typename T>
+T XMLDumpParser::number_value() const {
+    const char *begin = number_text;
+    const char *end = number_text + number_length;
+    if (begin < end && *begin == '+') {
+        begin++;
+    }
+
+    T value;
+    return parse_integer(begin, end, value) ? value : 0;
 }
 
 void XMLDumpParser::handleEndElement(const XML_Char *name) {
@@ -193,8 +513,9 @@ void XMLDumpParser::handleEndElement(const XML_Char *name) {
         assert(state == Page);
         state = Root;
 
-        if (mode == PerPage) {
+        if (mode == PerPage || (mode == Streaming && !page_announced)) {
             pages.push(current_page);
+            suspend();
         }
         return;
     }
@@ -204,6 +525,7 @@ void XMLDumpParser::handleEndElement(const XML_Char *name) {
         state = Page;
 
         revisions.push(current_revision);
+        suspend();
         return;
     }
 
@@ -216,7 +538,7 @@ void XMLDumpParser::handleEndElement(const XML_Char *name) {
     if (!strcmp(name, "ns")) {
         assert(state == Namespace);
         state = Page;
-        current_page->ns = atoi(accumulator.c_str());
+        current_page->ns = number_value<int32_t>();
         return;
     }
 
@@ -224,15 +546,15 @@ void XMLDumpParser::handleEndElement(const XML_Char *name) {
         assert(state == PageID || state == RevisionID || state == AuthorID);
         if (state == PageID) {
             state = Page;
-            current_page->id = atoi(accumulator.c_str());
+            current_page->id = number_value<int64_t>();
         }
         if (state == RevisionID) {
             state = Revision;
-            current_revision->id = atoi(accumulator.c_str());
+            current_revision->id = number_value<int64_t>();
         }
         if (state == AuthorID) {
             state = Contributor;
-            current_revision->author_id = atoi(accumulator.c_str());
+            current_revision->author_id = number_value<int64_t>();
         }
         return;
     }
@@ -270,6 +592,7 @@ void XMLDumpParser::handleEndElement(const XML_Char *name) {
     if (!strcmp(name, "text")) {
         assert(state == Text);
         state = Revision;
+        current_revision->text_stub &= current_revision->text.empty();
         return;
     }
 }
@@ -280,7 +603,7 @@ void XMLDumpParser::handleText(const XML_Char *text, int len) {
         case PageID:
         case RevisionID:
         case AuthorID:
-            accumulator.append(text, len);
+            append_number(text, len);
             break;
         case Title:
             current_page->title.append(text, len);
@@ -293,11 +616,14 @@ void XMLDumpParser::handleText(const XML_Char *text, int len) {
             break;
         case AuthorIP:
             current_revision->author_ip.append(text, len);
+            break;
         case Comment:
             current_revision->comment.append(text, len);
             break;
         case Text:
-            current_revision->text.append(text, len);
+            if (current_page != skipped_page) {
+                current_revision->text.append(text, len);
+            }
             break;
         default:
             // Ignore text outside of tags we're interested in
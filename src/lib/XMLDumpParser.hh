@@ -3,7 +3,9 @@
 
 #include <cstdint>
 #include <memory>
+#include <optional>
 #include <queue>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -12,25 +14,34 @@
 #include "CompressedDumpReader.hh"
 
 class XMLDumpParser;
+class RevisionStore;
+class SpillingRevisionBuffer;
 
 class MediaWikiPage {
   friend class XMLDumpParser;
+  friend class RevisionStore;
 
   private:
     std::string title;
     int32_t ns;
     int64_t id;
+    uint64_t offset;
 
   public:
     inline std::string get_title() const { return title; }
     inline int32_t get_namespace() const { return ns; }
     inline int64_t get_id() const { return id; }
+    // Offset of the <page> tag within the uncompressed dump
+    inline uint64_t get_offset() const { return offset; }
 };
 
 typedef std::shared_ptr<MediaWikiPage> MediaWikiPage_s;
 
 class MediaWikiRevision {
   friend class XMLDumpParser;
+  friend class RevisionStore;
+  friend class RevisionDataset;
+  friend class SpillingRevisionBuffer;
 
   private:
     int64_t id;
@@ -40,6 +51,7 @@ class MediaWikiRevision {
     int64_t author_id = -1;
     std::string comment;
     std::string text;
+    bool text_stub = false;
     MediaWikiPage_s page;
 
   public:
@@ -52,6 +64,9 @@ class MediaWikiRevision {
     inline std::string get_text() const { return text; }
     inline const char *get_text_ptr() const { return text.c_str(); }
     inline size_t get_text_size() const { return text.size(); }
+    // Whether the dump left out the text, as the stub dumps do, as opposed
+    // to the text being empty or deleted
+    inline bool is_text_stub() const { return text_stub; }
     inline MediaWikiPage_s get_page() const { return page; }
 };
 
@@ -62,9 +77,44 @@ struct MediaWikiPageHistory {
     std::vector<MediaWikiRevision_s> revisions;
 };
 
+/**
+ * How the parser hands the dump to Expat.  The dump is decompressed straight
+ * into Expat's own buffer, buffer_size bytes at a time; the size is clamped
+ * to between one byte and 512 MiB.  The parser throws std::bad_alloc if Expat
+ * cannot allocate the buffer.
+ */
+struct XMLDumpParserOptions {
+    // The maximum revision size on Wikipedia is two megabytes; at 4 MiB, the
+    // text of even the largest articles is rarely assembled from pieces.
+    size_t buffer_size = 4 * 1024 * 1024;
+    // Back Expat's large allocations, most notably its input buffer, with
+    // transparent huge pages
+    bool huge_pages = true;
+    // How the dump is read, if not as default_dump_input_options() says
+    std::optional<DumpInputOptions> input;
+};
+
+/**
+ * The options XMLDumpParser uses unless told otherwise.  They are initialized
+ * from the MWDUMP_XML_BUFFER_SIZE and MWDUMP_XML_HUGE_PAGES environment
+ * variables, and can be changed before creating any parsers.
+ */
+XMLDumpParserOptions &default_xml_dump_parser_options();
+
+/**
+ * Thrown by XMLDumpParser when the dump cannot be opened, does not reach the
+ * offset the parser was asked to start at, cannot be decompressed, is not
+ * well-formed XML or ends in the middle of a page.
+ */
+class XMLDumpError : public std::runtime_error {
+  public:
+    XMLDumpError(const std::string &what) : std::runtime_error(what) {}
+};
+
 enum XMLDumpParserMode {
     PerRevision,
-    PerPage
+    PerPage,
+    Streaming
 };
 
 class XMLDumpParser {
@@ -92,27 +142,60 @@ class XMLDumpParser {
 
     MediaWikiPage_s current_page;
     MediaWikiRevision_s current_revision;
-    std::string accumulator;
+
+    // The text of the numeric element being read, which Expat may deliver
+    // in several pieces.  Only the beginning matters, so it never allocates.
+    char number_text[32];
+    size_t number_length;
+
+    void start_number();
+    void append_number(const XML_Char *text, int len);
+    template <typename T> T number_value() const;
 
     std::queue<MediaWikiRevision_s> revisions;
     std::queue<MediaWikiPage_s> pages;
+    // The revision read_latest_revision() has read ahead
+    MediaWikiRevision_s latest_pending;
 
-    // Feed the data from the XML dump in 4 MiB chunks.  The maximum revision
-    // size on Wikipedia is two megabytes;  this way, we attempt to make sure
-    // that we do not have to assemble text of large articles piecewise from
-    // chunks, since we are going to load them into memory in their entirety
-    // anyways.
-    const size_t buffer_size = 4 * 1024 * 1024;
-    char *input_buffer;
+    size_t buffer_size;
     CompressedDumpReader_u input;
     bool input_finished = false;
 
+    // Difference between the offsets within the dump and the byte indices
+    // reported by Expat, which only start counting where we began to parse
+    int64_t offset_base = 0;
+
+    // In the Streaming mode, the parser is suspended every time it produces
+    // something, so that at most one revision is held in memory at a time.
+    bool suspended = false;
+    bool last_chunk = false;
+    bool page_announced = false;
+    MediaWikiPage_s stream_page;
+    // The page whose remaining revisions are being skipped
+    MediaWikiPage_s skipped_page;
+
+    void suspend();
+
+    void init_parser(const XMLDumpParserOptions &options);
+
     bool drive();
+    // Returns whether Expat suspended, and throws if the XML is not valid
+    bool parsed(XML_Status status, bool done);
     bool is_queue_empty();
     void fill_queue();
 
   public:
-    XMLDumpParser(const char *path, XMLDumpParserMode mode);
+    XMLDumpParser(const char *path, XMLDumpParserMode mode,
+                  const XMLDumpParserOptions &options = default_xml_dump_parser_options());
+
+    /**
+     * Opens the dump starting at the <page> tag located at the specified
+     * uncompressed offset, decompressing from the given restart point.  Both
+     * normally come from a DumpIndex.
+     */
+    XMLDumpParser(const char *path, XMLDumpParserMode mode,
+                  DumpRestartPoint restart, uint64_t offset,
+                  const XMLDumpParserOptions &options = default_xml_dump_parser_options());
     ~XMLDumpParser();
 
     /**
@@ -121,14 +204,44 @@ class XMLDumpParser {
      */
     MediaWikiRevision_s read_revision();
 
+    /**
+     * Reads the latest revision of the next page and returns it, skipping
+     * the older ones.  Works only when the mode is Revision.
+     */
+    MediaWikiRevision_s read_latest_revision();
+
     /**
      * Reads a page with its entire history and returns it.
      * Works only when the mode is Page.
      */
     MediaWikiPageHistory read_page();
 
+    /**
+     * Skips the rest of the current page and returns the next one as soon as
+     * its title, namespace and ID are known, before any revisions are read.
+     * Works only when the mode is Streaming.
+     */
+    MediaWikiPage_s next_page();
+
+    /**
+     * Returns the next revision of the current page, or nullptr once the page
+     * is over.  Works only when the mode is Streaming.
+     */
+    MediaWikiRevision_s next_revision();
+
+    /**
+     * Makes restart_point_for() work; has to be called before reading.
+     */
+    void keep_restart_points();
+
+    /**
+     * Returns the restart point from which the page at the specified offset
+     * can be reached.  Has to be called in the order the pages are read.
+     */
+    DumpRestartPoint restart_point_for(uint64_t offset);
+
     // Internal APIs used from Expat
-    void handleStartElement(const XML_Char *name);
+    void handleStartElement(const XML_Char *name, const XML_Char **attrs);
     void handleEndElement(const XML_Char *name);
     void handleText(const XML_Char *text, int len);
 };